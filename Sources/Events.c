@@ -34,6 +34,8 @@
 /* User includes (#include below this line is not maintained by Processor Expert) */
 #include <core/callbacks.h>
 #include <core/can.h>
+#include <core/can_error.h>
+#include <core/pt.h>
 #include <core/timer.h>
 
 /*
@@ -53,6 +55,7 @@
 void TickTimer_OnInterrupt(void)
 {
     timer_tick();
+    pt_list_tick();
 }
 
 /*
@@ -73,6 +76,47 @@ void CAN1_OnFullRxBuffer(void)
     can_rx_message();
 }
 
+/*
+** ===================================================================
+**     Event       :  CAN1_OnFreeTxBuffer (module Events)
+**
+**     Component   :  CAN1 [FreescaleCAN]
+**     Description :
+**         This event is called after a successful transmission of a
+**         message. The event is available only if Interrupt
+**         service/event is enabled.
+**     Parameters  :
+**         NAME            - DESCRIPTION
+**         BufferMask      - Transmit buffer mask. The mask can be
+**                           used to check what message buffer caused
+**                           the transmit interrupt.
+**     Returns     : Nothing
+** ===================================================================
+*/
+void CAN1_OnFreeTxBuffer(word BufferMask)
+{
+    (void)BufferMask;
+    can_tx_free();
+}
+
+/*
+** ===================================================================
+**     Event       :  CAN1_OnBusOff (module Events)
+**
+**     Component   :  CAN1 [FreescaleCAN]
+**     Description :
+**         This event is called when the node status becomes bus-off.
+**         The event is available only if Interrupt service/event is
+**         enabled.
+**     Parameters  : None
+**     Returns     : Nothing
+** ===================================================================
+*/
+void CAN1_OnBusOff(void)
+{
+    can_error_bus_off();
+}
+
 /*
 ** ===================================================================
 **     Event       :  AD1_OnEnd (module Events)
@@ -89,6 +133,7 @@ void CAN1_OnFullRxBuffer(void)
 */
 void AD1_OnEnd(void)
 {
+    pt_list_signal(PT_EVENT_ADC);
     app_adc_ready();
 }
 
@@ -89,6 +89,40 @@ void CAN1_OnFullRxBuffer(void);
 ** ===================================================================
 */
 
+void CAN1_OnFreeTxBuffer(word BufferMask);
+/*
+** ===================================================================
+**     Event       :  CAN1_OnFreeTxBuffer (module Events)
+**
+**     Component   :  CAN1 [FreescaleCAN]
+**     Description :
+**         This event is called after a successful transmission of a
+**         message. The event is available only if Interrupt
+**         service/event is enabled.
+**     Parameters  :
+**         NAME            - DESCRIPTION
+**         BufferMask      - Transmit buffer mask. The mask can be
+**                           used to check what message buffer caused
+**                           the transmit interrupt.
+**     Returns     : Nothing
+** ===================================================================
+*/
+
+void CAN1_OnBusOff(void);
+/*
+** ===================================================================
+**     Event       :  CAN1_OnBusOff (module Events)
+**
+**     Component   :  CAN1 [FreescaleCAN]
+**     Description :
+**         This event is called when the node status becomes bus-off.
+**         The event is available only if Interrupt service/event is
+**         enabled.
+**     Parameters  : None
+**     Returns     : Nothing
+** ===================================================================
+*/
+
 void AD1_OnEnd(void);
 /*
 ** ===================================================================
@@ -26,6 +26,9 @@ app_init()
 /**
  * Called each time around the main loop. 
  * 
+ * The main loop idles when no thread is runnable, so this is called
+ * at least once per timer tick but not continuously.
+ * 
  * Blocking this loop will affect the functioning of other parts
  * of the system; blocking for long enough will eventually trip 
  * the watchdog.
@@ -64,6 +67,16 @@ app_can_idle(bool is_idle)
     (void)is_idle;
 }
 
+void
+app_isotp_receive(const uint8_t *data, uint16_t len)
+{
+#ifdef APPLET_ISOTP_RECEIVE
+	APPLET_ISOTP_RECEIVE(data, len);
+#endif
+    (void)data;
+    (void)len;
+}
+
 void
 app_adc_ready(void)
 {
@@ -20,6 +20,7 @@
 #include <AD1.h>
 #include <IEE1.h>
 
+#include <core/eeprom.h>
 #include <core/io.h>
 #include <core/pt.h>
 #include <core/timer.h>
@@ -267,7 +268,7 @@ hsd_calibration_thread(struct pt *pt)
             }
         } while (!timer_expired(sample_timer));
         print("CS%d: %d", current_channel + 1, stable_value);
-        (void)IEE1_SetWord(EE_CAL_BASE_1A + 2 * current_channel, stable_value);
+        pt_wait(pt, eeprom_write_word(EE_CAL_BASE_1A + 2 * current_channel, stable_value, NULL));
         if (mrs_module_type == 'X') {
 			do {
 				pt_yield(pt);
@@ -278,7 +279,7 @@ hsd_calibration_thread(struct pt *pt)
 				}
 			} while (!timer_expired(sample_timer));
 			print("OP%d: %d", current_channel + 1, stable_value);
-			(void)IEE1_SetWord(EE_CAL_BASE_10V + 2 * current_channel, stable_value);
+			pt_wait(pt, eeprom_write_word(EE_CAL_BASE_10V + 2 * current_channel, stable_value, NULL));
         }
     }
     // Do initial calibration setup for 2.5
@@ -314,9 +315,12 @@ hsd_calibration_thread(struct pt *pt)
             }
         } while (!timer_expired(sample_timer));
         print("CS%d: %d", current_channel + 1, stable_value);
-        (void)IEE1_SetWord(EE_CAL_BASE_2_5A + 2 * current_channel, stable_value);
+        pt_wait(pt, eeprom_write_word(EE_CAL_BASE_2_5A + 2 * current_channel, stable_value, NULL));
     }
     
+    // let the calibration values reach the EEPROM before reading them back
+    pt_wait(pt, !eeprom_busy());
+
     print("");
     print("Calibration summary:");
     for (current_channel = 0; current_channel < num_channels; current_channel++) {
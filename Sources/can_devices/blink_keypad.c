@@ -6,6 +6,7 @@
 
 #include <config.h>
 
+#include <core/can_cyclic.h>
 #include <core/lib.h>
 #include <core/pt.h>
 #include <core/timer.h>
@@ -43,26 +44,58 @@ static uint8_t      	blink_phase;
 static void             bk_thread(struct pt *pt);
 static void             bk_tick(void);
 static timer_call_t     bk_tick_call = {
+        { NULL, BK_TICK_PERIOD_MS },
         bk_tick,
         BK_TICK_PERIOD_MS,
-        BK_TICK_PERIOD_MS
+        TIMER_CALL_THREAD           // key counters are also updated by bk_can_receive
 };
 
 static timer_t          bk_idle_timer;
+static pt_list_entry_t  bk_thread_entry = pt_list_entry(bk_thread, PT_EVENT_TIMER);
+
+// LED and intensity state is refreshed periodically, which also drives
+// the blink animation
+static uint8_t          bk_build_led_refresh(can_cyclic_t *entry, uint8_t *data);
+static uint8_t          bk_build_intensity_refresh(can_cyclic_t *entry, uint8_t *data);
+static can_cyclic_t     bk_led_refresh = {
+        0,                          // ID set once the keypad is found
+        BK_BLINK_PERIOD_MS,
+        CAN_CYCLIC_STAGGER,
+        bk_build_led_refresh
+};
+static can_cyclic_t     bk_intensity_refresh = {
+        0,
+        BK_BLINK_PERIOD_MS,
+        CAN_CYCLIC_STAGGER,
+        bk_build_intensity_refresh
+};
+
+static void
+bk_can_handler(can_buf_t *buf, void *ctx)
+{
+    (void)ctx;
+    (void)bk_can_receive(buf);
+}
 
 void
 bk_init(void)
 {
     timer_call_register(bk_tick_call);
     timer_register(bk_idle_timer);
-}
+    pt_list_register(&bk_thread_entry);
 
-void
-bk_loop(void)
-{
-    static struct pt bk_pt;
-    
-    bk_thread(&bk_pt);
+#ifdef BK_FIXED_KEYPAD_ID
+    // PDOs and SDO responses from the configured keypad only
+    can_rx_register(0x180 + BK_FIXED_KEYPAD_ID, 0x7ff, bk_can_handler, NULL);
+    can_rx_register(0x580 + BK_FIXED_KEYPAD_ID, 0x7ff, bk_can_handler, NULL);
+#else
+    // The keypad ID is learned from its boot message and handlers can't
+    // be re-registered, so boot messages, PDOs and SDO responses from any
+    // node are accepted; bk_can_receive ignores those from other nodes.
+    can_rx_register(0x700, 0x780, bk_can_handler, NULL);
+    can_rx_register(0x180, 0x780, bk_can_handler, NULL);
+    can_rx_register(0x580, 0x780, bk_can_handler, NULL);
+#endif
 }
 
 uint8_t
@@ -71,26 +104,6 @@ bk_num_keys(void)
 	return num_keys;
 }
 
-bool
-bk_can_filter(can_buf_t *buf)
-{
-	// if we don't have a keypad ID the only thing we want is a boot message
-    if (keypad_id == 0xff) {
-        if ((buf->id >= 0x700) && (buf->id <= 0x77f)) {
-        	return TRUE;
-        }
-        return FALSE;
-    }
-    
-    // filter messages of interest
-    switch (buf->id - keypad_id) {
-    case 0x580:
-    case 0x180:
-    	return TRUE;
-    }
-    return FALSE;
-}
-
 bool
 bk_can_receive(can_buf_t *buf)
 {
@@ -211,6 +224,7 @@ bk_set_key_led(uint8_t key, uint8_t colors, uint8_t pattern)
     led_state[key].color_b = (colors >> 4) & BK_COLOR_MASK;
     led_state[key].pattern = pattern;
     update_flags |= UPDATE_KEYS;
+    pt_list_wake(&bk_thread_entry);
 }
 
 void
@@ -218,6 +232,7 @@ bk_set_key_intensity(uint8_t intensity)
 {
     key_intensity = intensity & BK_MAX_INTENSITY;    
     update_flags |= UPDATE_INTENSITY;
+    pt_list_wake(&bk_thread_entry);
 }
 
 void
@@ -231,6 +246,7 @@ bk_set_backlight_intensity(uint8_t intensity)
 {
     backlight_intensity = intensity & BK_MAX_INTENSITY;
     update_flags |= UPDATE_INTENSITY;
+    pt_list_wake(&bk_thread_entry);
 }
 
 uint8_t
@@ -246,12 +262,14 @@ bk_get_key_led(uint8_t key)
 }
 
 static void
-bk_send_led_update()
+bk_build_led_update(uint8_t *data)
 {
     const uint8_t bit_offset = (num_keys == 12) ? 12 : (num_keys == 10) ? 16 : 8;
     uint8_t i;
-    uint8_t data[8] = {0};
 
+    for (i = 0; i < 8; i++) {
+        data[i] = 0;
+    }
     for (i = 0; i < num_keys; i++) {
         uint8_t color = bk_get_key_led(i);
         uint8_t offset = i;
@@ -268,25 +286,69 @@ bk_send_led_update()
             data[offset / 8] |= 1 << (offset % 8);
         }
     }
-    can_tx_async(0x200 + keypad_id, sizeof(data), data);    
+}
+
+static void
+bk_send_led_update()
+{
+    uint8_t data[8];
+
+    bk_build_led_update(&data[0]);
+    (void)can_tx_async(0x200 + keypad_id, sizeof(data), data);    
+}
+
+static uint8_t
+bk_build_led_refresh(can_cyclic_t *entry, uint8_t *data)
+{
+    (void)entry;
+
+    blink_phase = (blink_phase + 1) & 0x7;
+    bk_build_led_update(data);
+    return 8;
+}
+
+/*
+ * Build one of the intensity / backlight SDO writes; sub-index 2 is key
+ * intensity, 3 backlight intensity and 4 backlight color.
+ */
+static void
+bk_build_intensity_update(uint8_t *data, uint8_t subindex)
+{
+    data[0] = 0x23;
+    data[1] = 0x00;
+    data[2] = 0x65;
+    data[3] = 0x01;
+    data[4] = subindex;
+    data[5] = (subindex == 0x02) ? key_intensity
+              : (subindex == 0x03) ? backlight_intensity
+              : backlight_color;
+    data[6] = 0x00;
+    data[7] = 0x00;
 }
 
 static void
 bk_send_intensity_update()
 {
-    uint8_t data[8] = {0x23, 0x00, 0x65, 0x01 };
-    
-    data[4] = 0x02;
-    data[5] = key_intensity;
-    can_tx_async(0x600 + keypad_id, sizeof(data), data);
+    uint8_t data[8];
+    uint8_t subindex;
 
-    data[4] = 0x03; 
-    data[5] = backlight_intensity;
-    can_tx_async(0x600 + keypad_id, sizeof(data), data);
+    for (subindex = 0x02; subindex <= 0x04; subindex++) {
+        bk_build_intensity_update(&data[0], subindex);
+        (void)can_tx_async(0x600 + keypad_id, sizeof(data), data);
+    }
+}
+
+static uint8_t
+bk_build_intensity_refresh(can_cyclic_t *entry, uint8_t *data)
+{
+    static uint8_t subindex = 0x02;
 
-    data[4] = 0x04; 
-    data[5] = backlight_color;
-    can_tx_async(0x600 + keypad_id, sizeof(data), data);
+    (void)entry;
+
+    // refresh one setting each period
+    bk_build_intensity_update(data, subindex);
+    subindex = (subindex >= 0x04) ? 0x02 : (subindex + 1);
+    return 8;
 }
 
 static void
@@ -318,7 +380,7 @@ bk_thread(struct pt *pt)
                 // to have it hardcoded.
                 //
                 static const uint8_t bk_reset_all[] = {0x81, 0x00};
-                can_tx_ordered(0x00, sizeof(bk_reset_all), bk_reset_all);
+                (void)can_tx_ordered(0x00, sizeof(bk_reset_all), bk_reset_all);
                 continue;
             }
 
@@ -341,7 +403,7 @@ bk_thread(struct pt *pt)
             	uint8_t i;
 
             	for (i = 0; i < (sizeof(bk_init_messages) / 8); i++) {
-            		can_tx_ordered(0x600 + keypad_id, 8, &bk_init_messages[i][0]);
+            		(void)can_tx_ordered(0x600 + keypad_id, 8, &bk_init_messages[i][0]);
             		pt_yield(pt);
             	}
             }
@@ -349,29 +411,23 @@ bk_thread(struct pt *pt)
 
         // we've found a keypad and we know how big it is, use it
         print("keypad @ %x with %d keys", keypad_id, num_keys);
+        bk_led_refresh.id = 0x200 + keypad_id;
+        bk_intensity_refresh.id = 0x600 + keypad_id;
+        can_cyclic_register(&bk_led_refresh);
+        can_cyclic_register(&bk_intensity_refresh);
         for (;;) {
-            
-            // Wait until it's time to send an update; either because it's time
-            // for a new animation iteration or because an LED state change was
-            // requested.
-            pt_wait(pt, timer_expired(blink_timer) || (update_flags & UPDATE_KEYS));
+            uint8_t flags;
+
+            // Send LED and intensity changes as soon as they are requested;
+            // the periodic refreshes take care of the animation.
+            pt_wait(pt, update_flags != 0);
+            flags = update_flags;
             update_flags = 0;
-            if (timer_expired(blink_timer)) {
-                timer_reset(blink_timer, BK_BLINK_PERIOD_MS);
-                blink_phase = (blink_phase + 1) & 0x7;
+            if (flags & UPDATE_KEYS) {
+                bk_send_led_update();
             }
-            bk_send_led_update();
-            
-            // this is kind of spammy, may want to be frugal with it
-            bk_send_intensity_update();
-            
-            // if the keypad disappears, release every key
-            if (timer_expired(bk_idle_timer)) {
-                uint8_t i;
-                
-                for (i = 0; i < num_keys; i++) {
-                    key_state[i].counter = 0;
-                }
+            if (flags & UPDATE_INTENSITY) {
+                bk_send_intensity_update();
             }
         }
     }
@@ -397,7 +453,7 @@ bk_set_can_speed(uint8_t kbps)
 	default:
 		data[4] = 4;
 	}
-	can_tx_async(0x600 + keypad_id, sizeof(data), data);
+	(void)can_tx_async(0x600 + keypad_id, sizeof(data), data);
 }
 
 static void
@@ -405,6 +461,14 @@ bk_tick(void)
 {
     int i;
     
+    // if the keypad disappears, release every key
+    if (timer_expired(bk_idle_timer)) {
+        for (i = 0; i < num_keys; i++) {
+            key_state[i].counter = 0;
+        }
+        return;
+    }
+
     for (i = 0; i < num_keys; i++) {
         if ((key_state[i].counter > 0) && (key_state[i].counter < 255)) {
             key_state[i].counter++;
@@ -62,14 +62,15 @@
 
 /**
  * Initialize keypad support. 
+ * 
+ * Registers the keypad thread on the thread list, and CAN receive
+ * handlers for keypad messages. With BK_FIXED_KEYPAD_ID the handlers
+ * accept only that keypad's PDOs and SDO responses; otherwise they
+ * accept 0x180-0x1ff, 0x580-0x5ff and 0x700-0x77f from any node, and
+ * those frames are not seen by app_can_filter.
  */
 extern void bk_init(void);
 
-/**
- * Call to run the keypad logic.
- */
-extern void bk_loop(void);
-
 /**
  * Get the number of keys on the keypad.
  *  
@@ -78,16 +79,10 @@ extern void bk_loop(void);
  */
 extern uint8_t bk_num_keys(void);
 
-/**
- * Sniff a CAN message and decide whether we're interested in it.
- */
-extern bool bk_can_filter(can_buf_t *buf);
-
 /**
  * Feed a received CAN message to the keypad handler.
  * 
- * Should be called from app_can_receive for any message that
- * might be from a keypad.
+ * Called by the CAN receive handlers registered by bk_init.
  * 
  * @param buf           The CAN message buffer.
  * @returns             TRUE if the message was consumed, FALSE 
@@ -11,9 +11,163 @@
 #define CAN_IDLE_TIMEOUT            2000
 
 /*
- * Size of the CAN receive FIFO.
+ * Put the CPU into WAIT mode when there is nothing to run. Comment out
+ * to busy-wait instead, e.g. if the debugger has trouble with WAIT.
  */
-#define CAN_RX_FIFO_SIZE			8
+#define CONFIG_IDLE_WAIT
+
+/*
+ * Collect per-thread runtime statistics and print them to the console
+ * every PT_PROFILE_REPORT_MS. Leave disabled for production builds.
+ */
+//#define CONFIG_PT_PROFILE
+#define PT_PROFILE_REPORT_MS        5000
+
+/*
+ * Sizes of the CAN receive FIFOs; each must be a power of 2.
+ *
+ * Bootrom (MRS) frames, high-priority application frames and everything
+ * else are queued separately, so that a flood of application traffic
+ * can't crowd out flasher commands or control frames.
+ */
+#define CAN_RX_BOOTROM_FIFO_SIZE    2
+#define CAN_RX_HIGH_FIFO_SIZE       4
+#define CAN_RX_LOW_FIFO_SIZE        8
+
+/*
+ * Standard-format frames with IDs below this are queued as high priority;
+ * covers CANopen NMT, SYNC and EMCY.
+ */
+#define CAN_RX_HIGH_ID_LIMIT        0x100
+
+/*
+ * Timestamp received CAN messages; costs 4 bytes per queued CAN message.
+ */
+#define CONFIG_CAN_RX_TIMESTAMP
+
+/*
+ * Decode received CAN frames straight from the MSCAN registers into the
+ * receive FIFO, rather than through CAN1_ReadFrame.
+ *
+ * To compare the two, build with CONFIG_PT_PROFILE, with and without
+ * this, and feed each build the same steady traffic (e.g. 8-byte
+ * extended frames at a fixed rate that no handler claims). The console
+ * reports "canrx ... n=<frames> tot=<counts> max=<counts>" every
+ * PT_PROFILE_REPORT_MS; tot/n is the mean and max the worst receive
+ * interrupt, in TPM2 counts. Multiply by the TPM2SC prescaler for bus
+ * cycles. Both builds pay the same profiling overhead, so the difference
+ * is the decode.
+ */
+#define CONFIG_CAN_RX_DIRECT
+
+/*
+ * Time can_listen may spend handling received frames before yielding to
+ * other threads, in timer_counter() counts. A pass also ends if the
+ * millisecond clock advances by more than one tick.
+ */
+#define CAN_LISTEN_BUDGET           2000
+
+/*
+ * Maximum number of ID ranges that can be registered with can_filter_add.
+ */
+#define CAN_FILTER_MAX              8
+
+/*
+ * Maximum number of CAN receive handlers; each also uses one of the
+ * CAN_FILTER_MAX filter registrations.
+ */
+#define CAN_RX_HANDLER_MAX          8
+
+/*
+ * CAN statistics sampling period (ms), and the 29-bit ID of the status
+ * frame broadcast every period; define CAN_STATS_ID to start
+ * broadcasting. Keep it out of the MRS range (0x1ffffff0-0x1fffffff),
+ * or other modules will queue it as a flasher command.
+ */
+#define CAN_STATS_PERIOD_MS         1000
+//#define CAN_STATS_ID                0x1fffffe0
+
+/*
+ * Bus-off recovery (ms): the first back-off before restarting the
+ * controller, the longest it will double to, how long the bus must
+ * stay up before recovery is considered complete, and how long the
+ * transceiver is given to settle into normal mode before its error
+ * output is sampled (at least 2, as the tick is 1ms).
+ */
+#define CAN_BUS_OFF_BACKOFF_MIN_MS  50
+#define CAN_BUS_OFF_BACKOFF_MAX_MS  2000
+#define CAN_BUS_OFF_STABLE_MS       1000
+#define CAN_BUS_OFF_SETTLE_MS       2
+
+/*
+ * Time interrupt-time CAN receive handlers against their declared
+ * budgets and report overruns. For debug builds.
+ */
+//#define CONFIG_CAN_RX_ISR_CHECK
+
+/*
+ * Sizes of the CAN transmit queues; the ordered and console
+ * queue sizes must be powers of 2.
+ */
+#define CAN_TX_ORDERED_QUEUE_SIZE   8
+#define CAN_TX_ASYNC_QUEUE_SIZE     8
+#define CAN_TX_CONSOLE_QUEUE_SIZE   4
+
+/*
+ * Spacing (ms) between periodic CAN messages registered with
+ * CAN_CYCLIC_STAGGER.
+ */
+#define CAN_CYCLIC_STAGGER_MS       5
+
+/*
+ * Size of the CAN console output buffer; must be a power of 2, <= 128.
+ */
+#define CAN_CONSOLE_BUFFER_SIZE     128
+
+/*
+ * ISO-TP transport: message buffer size (each of send and receive),
+ * the block size and STmin (ms) we ask senders for, the timeout (ms)
+ * waiting for flow control or the next consecutive frame, and the
+ * frame padding byte.
+ */
+#define ISOTP_BUFFER_SIZE           128
+#define ISOTP_BLOCK_SIZE            8
+#define ISOTP_STMIN_MS              0
+#define ISOTP_TIMEOUT_MS            1000
+#define ISOTP_PADDING               0xcc
+
+/*
+ * Number of bytes that can be waiting to be written to EEPROM; must be
+ * a power of 2, <= 128.
+ */
+#define EEPROM_WRITE_QUEUE_SIZE     32
+
+/*
+ * Keep firmware settings and counters in a journaled key/value store in
+ * the EEPROM user area (0x200-0x400); the MRS EEPROM write command then
+ * refuses to write that area. Keys are 0 to KV_KEYS - 1, values are up
+ * to KV_VALUE_MAX bytes.
+ */
+//#define CONFIG_KV_STORE
+#define KV_KEYS                     16
+#define KV_VALUE_MAX                8
+
+/*
+ * MRS scan responses are spread over MRS_SCAN_SLOTS slots of
+ * MRS_SCAN_SLOT_MS, instead of being sent all at once. Modules sharing a
+ * slot send the same ID at once and garble each other, so the host has
+ * to scan again (after the window has passed) until every module has
+ * answered. The first scan after reset uses the serial number modulo
+ * MRS_SCAN_SLOTS, which gives up to MRS_SCAN_SLOTS modules with
+ * consecutive serial numbers a slot each; later scans hash the serial
+ * number with the scan count, so the same modules are unlikely to
+ * collide again. With 32 slots, 20 modules with unrelated serial numbers
+ * take about 5 scans (320ms) to all be found, and 32 modules about 9
+ * (see Tests/scan_slots_sim.c). A slot should hold one extended frame at
+ * the slowest bitrate. MRS_SCAN_SLOTS of 1 answers immediately.
+ */
+#define MRS_SCAN_SLOTS              32
+#define MRS_SCAN_SLOT_MS            2
 
 /*
  * Minimum load current (mA): below this, output is considered open.
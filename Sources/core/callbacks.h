@@ -11,7 +11,9 @@
 /**
  * Application CAN filter.
  * 
- * Called at interrupt time when a message is received.
+ * Called at interrupt time when a message is received that matches
+ * no handler registered with can_rx_register or can_rx_register_isr;
+ * the latter is the preferred way to act on a message immediately.
  * 
  * @param buf		CAN message.
  * @return			TRUE if the message should be queued for processing,
@@ -39,6 +41,17 @@ extern void app_can_receive(can_buf_t *buf);
  */
 extern void app_can_idle(bool is_idle);
 
+/**
+ * ISO-TP message received.
+ * 
+ * Called on the CAN listener thread when a complete message has been
+ * received by the ISO-TP transport (see <core/isotp.h>).
+ * 
+ * @param data      The message; only valid until the callback returns.
+ * @param len       Length of the message.
+ */
+extern void app_isotp_receive(const uint8_t *data, uint16_t len);
+
 /**
  * ADC cycle complete callback.
  * 
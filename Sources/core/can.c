@@ -8,6 +8,8 @@
 
 #include <core/callbacks.h>
 #include <core/can.h>
+#include <core/can_error.h>
+#include <core/can_stats.h>
 #include <core/lib.h>
 #include <core/mrs_bootrom.h>
 #include <core/pt.h>
@@ -15,13 +17,32 @@
 
 #include <can_devices/blink_keypad.h>
 
-static can_buf_t            can_rx_fifo[CAN_RX_FIFO_SIZE];
-static volatile uint8_t     can_buf_head;
-static uint8_t              can_buf_tail;
-#define _CAN_BUF_INDEX(_x)  ((_x) & (uint8_t)(CAN_RX_FIFO_SIZE - 1))
-#define CAN_BUF_PTR(_x)     &can_rx_fifo[_CAN_BUF_INDEX(_x)]
-#define CAN_BUF_EMPTY       (can_buf_head == can_buf_tail)
-#define CAN_BUF_FULL        ((can_buf_head - can_buf_tail) >= CAN_RX_FIFO_SIZE)
+/*
+ * Receive FIFOs, one per priority lane.
+ */
+typedef struct {
+    can_buf_t           *buf;
+    uint8_t             mask;               // size - 1, size must be a power of 2
+    volatile uint8_t    head;               // updated by the ISR
+    uint8_t             tail;
+    uint8_t             max_depth;          // high-water mark
+    uint16_t            overflows;
+} can_rx_fifo_t;
+
+static can_buf_t            can_rx_bootrom_buf[CAN_RX_BOOTROM_FIFO_SIZE];
+static can_buf_t            can_rx_high_buf[CAN_RX_HIGH_FIFO_SIZE];
+static can_buf_t            can_rx_low_buf[CAN_RX_LOW_FIFO_SIZE];
+static can_rx_fifo_t        can_rx_fifo[CAN_RX_LANES] = {
+    { &can_rx_bootrom_buf[0], CAN_RX_BOOTROM_FIFO_SIZE - 1 },
+    { &can_rx_high_buf[0],    CAN_RX_HIGH_FIFO_SIZE - 1 },
+    { &can_rx_low_buf[0],     CAN_RX_LOW_FIFO_SIZE - 1 },
+};
+static can_buf_t            can_rx_scratch;
+static uint16_t             can_listen_budget_hit_count;
+
+#define CAN_RX_FIFO_EMPTY(_f)   ((_f)->head == (_f)->tail)
+#define CAN_RX_FIFO_FULL(_f)    ((uint8_t)((_f)->head - (_f)->tail) > (_f)->mask)
+#define CAN_RX_FIFO_PTR(_f, _x) (&(_f)->buf[(_x) & (_f)->mask])
 
 void
 _can_trace(uint8_t code)
@@ -35,54 +56,806 @@ _can_trace(uint8_t code)
     } while (ret != ERR_OK);
 }
 
+/*
+ * Software transmit queues.
+ *
+ * Frames are queued here and loaded into the MSCAN transmit buffers as
+ * they become free, either immediately from the caller or from the
+ * TX-empty interrupt.
+ *
+ * The ordered and console lanes are FIFOs that only ever have one frame
+ * in a transmit buffer at a time, so each is sent in order. The async
+ * lane is kept sorted by CAN arbitration priority. Whenever a buffer is
+ * free, the most urgent frame at the head of any lane is loaded into it,
+ * and the local transmit priority register is set from the frame ID so
+ * that MSCAN also sends the most urgent pending frame first.
+ */
+typedef struct {
+    can_buf_t   buf;
+    uint16_t    queued_ms;                  // for latency measurement
+} can_tx_entry_t;
+
+typedef struct {
+    can_tx_entry_t  *entry;
+    uint8_t         mask;                   // size - 1, size must be a power of 2
+    uint8_t         head;
+    uint8_t         tail;
+    uint8_t         inflight;               // transmit buffer holding this lane's frame, 0 if none
+} can_tx_fifo_t;
+
+static can_tx_entry_t       can_tx_ordered_fifo[CAN_TX_ORDERED_QUEUE_SIZE];
+static can_tx_entry_t       can_tx_console_fifo[CAN_TX_CONSOLE_QUEUE_SIZE];
+static can_tx_fifo_t        can_tx_ordered_lane = { can_tx_ordered_fifo, CAN_TX_ORDERED_QUEUE_SIZE - 1 };
+static can_tx_fifo_t        can_tx_console_lane = { can_tx_console_fifo, CAN_TX_CONSOLE_QUEUE_SIZE - 1 };
+static can_tx_entry_t       can_tx_async_queue[CAN_TX_ASYNC_QUEUE_SIZE];    // most urgent last
+static uint8_t              can_tx_async_count;
+static uint16_t             can_tx_drops;
+static can_tx_latency_t     can_tx_latencies[CAN_TX_PRIORITY_CLASSES];
+
+static void                 can_console_thread(struct pt *pt);
+static pt_list_entry_t      can_console_entry = pt_list_entry(can_console_thread, 0);
+
+#define CAN_TX_BUFFERS          0x07
+#define CAN_TX_FIFO_EMPTY(_l)   ((_l)->head == (_l)->tail)
+#define CAN_TX_FIFO_FULL(_l)    ((uint8_t)((_l)->head - (_l)->tail) > (_l)->mask)
+#define CAN_TX_FIFO_PTR(_l, _x) &(_l)->entry[(_x) & (_l)->mask]
+#define CAN_TX_FIFO_SENT(_l)    (((_l)->inflight == 0) || (CANTFLG & (_l)->inflight))
+
+/*
+ * Sort key that orders frames the way CAN arbitration would; lower
+ * values win. The 11-bit base ID is followed by the IDE bit (standard
+ * frames win over extended frames with the same base ID) and then the
+ * 18-bit ID extension.
+ */
+static uint32_t
+can_tx_key(uint32_t id)
+{
+    if (id & CAN_EXTENDED_FRAME_ID) {
+        id &= 0x1fffffffUL;
+        return ((id >> 18) << 19) | (1UL << 18) | (id & 0x3ffffUL);
+    }
+    return (id & 0x7ffUL) << 19;
+}
+
+#define CAN_TX_KEY_PRIORITY(_k) (uint8_t)((_k) >> 22)   // local priority, from the top 8 bits of the base ID
+#define CAN_TX_KEY_CLASS(_k)    (uint8_t)((_k) >> 28)   // latency class, from the top 2 bits of the base ID
+
+/*
+ * Load a frame into a transmit buffer and start sending it.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+can_tx_load(const can_buf_t *buf, uint8_t bufmask, uint8_t priority)
+{
+    const uint32_t id = buf->id;
+    uint8_t i;
+
+    CANTBSEL = bufmask;
+
+    if (id & CAN_EXTENDED_FRAME_ID) {
+        CANTIDR0 = (uint8_t)(id >> 21);
+        CANTIDR1 = ((uint8_t)(id >> 13) & 0xe0)     /* ID20-18 */
+                   | 0x18                           /* SRR, IDE */
+                   | ((uint8_t)(id >> 15) & 0x07);  /* ID17-15 */
+        CANTIDR2 = (uint8_t)(id >> 7);
+        CANTIDR3 = (uint8_t)(id << 1);              /* RTR = 0 */
+    } else {
+        CANTIDR0 = (uint8_t)(id >> 3);
+        CANTIDR1 = (uint8_t)(id << 5);              /* RTR = 0, IDE = 0 */
+    }
+    for (i = 0; i < buf->dlc; i++) {
+        (&CANTDSR0)[i] = buf->data[i];
+    }
+    CANTDLR = buf->dlc;
+    CANTTBPR = priority;
+    can_stats_tx_frame(buf);
+
+    /* clearing TXE schedules the buffer; interrupt when it's empty again */
+    CANTFLG = bufmask;
+    CANTIER |= bufmask;
+}
+
+/*
+ * Move as many queued frames as possible into free transmit buffers,
+ * most urgent first.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+can_tx_refill(void)
+{
+    uint8_t free_mask;
+
+    // forget about FIFO frames that have been sent
+    if (CAN_TX_FIFO_SENT(&can_tx_ordered_lane)) {
+        can_tx_ordered_lane.inflight = 0;
+    }
+    if (CAN_TX_FIFO_SENT(&can_tx_console_lane)) {
+        can_tx_console_lane.inflight = 0;
+    }
+
+    while ((free_mask = (CANTFLG & CAN_TX_BUFFERS)) != 0) {
+        can_tx_fifo_t *lane = NULL;
+        can_tx_entry_t *entry = NULL;
+        uint32_t key = 0xffffffffUL;
+        can_tx_latency_t *latency;
+        uint16_t latency_ms;
+
+        // find the most urgent frame that can be sent now
+        if (can_tx_async_count > 0) {
+            entry = &can_tx_async_queue[can_tx_async_count - 1];
+            key = can_tx_key(entry->buf.id);
+        }
+        if (!CAN_TX_FIFO_EMPTY(&can_tx_ordered_lane) && (can_tx_ordered_lane.inflight == 0)) {
+            can_tx_entry_t *e = CAN_TX_FIFO_PTR(&can_tx_ordered_lane, can_tx_ordered_lane.tail);
+            uint32_t k = can_tx_key(e->buf.id);
+
+            if (k < key) {
+                lane = &can_tx_ordered_lane;
+                entry = e;
+                key = k;
+            }
+        }
+        if (!CAN_TX_FIFO_EMPTY(&can_tx_console_lane) && (can_tx_console_lane.inflight == 0)) {
+            can_tx_entry_t *e = CAN_TX_FIFO_PTR(&can_tx_console_lane, can_tx_console_lane.tail);
+            uint32_t k = can_tx_key(e->buf.id);
+
+            if (k < key) {
+                lane = &can_tx_console_lane;
+                entry = e;
+                key = k;
+            }
+        }
+        if (entry == NULL) {
+            break;
+        }
+
+        // load it into the lowest-numbered free buffer
+        free_mask &= (uint8_t)-free_mask;
+        can_tx_load(&entry->buf, free_mask, CAN_TX_KEY_PRIORITY(key));
+
+        latency = &can_tx_latencies[CAN_TX_KEY_CLASS(key)];
+        latency_ms = (uint16_t)timer_now_ms() - entry->queued_ms;
+        latency->frames++;
+        latency->total_ms += latency_ms;
+        if (latency_ms > latency->max_ms) {
+            latency->max_ms = latency_ms;
+        }
+
+        if (lane != NULL) {
+            lane->tail++;
+            lane->inflight = free_mask;
+        } else {
+            can_tx_async_count--;
+        }
+    }
+}
+
+/*
+ * Add a frame to a FIFO lane and kick the transmitter.
+ */
+static bool
+can_tx_enqueue(can_tx_fifo_t *lane, uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    can_tx_entry_t *entry;
+    uint8_t i;
+
+    if (dlc > sizeof(entry->buf.data)) {
+        return FALSE;
+    }
+
+    EnterCritical();
+
+    if (CAN_TX_FIFO_FULL(lane)) {
+        can_tx_drops++;
+        ExitCritical();
+        return FALSE;
+    }
+    entry = CAN_TX_FIFO_PTR(lane, lane->head);
+    entry->buf.id = id;
+    entry->buf.dlc = dlc;
+    for (i = 0; i < dlc; i++) {
+        entry->buf.data[i] = data[i];
+    }
+    entry->queued_ms = (uint16_t)timer_now_ms();
+    lane->head++;
+    can_tx_refill();
+
+    ExitCritical();
+    return TRUE;
+}
+
+bool
+can_tx_async(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    const uint32_t key = can_tx_key(id);
+    can_tx_entry_t *entry;
+    uint8_t index;
+    uint8_t i;
+
+    if (dlc > sizeof(entry->buf.data)) {
+        return FALSE;
+    }
+
+    EnterCritical();
+
+    if (can_tx_async_count >= CAN_TX_ASYNC_QUEUE_SIZE) {
+        can_tx_drops++;
+        ExitCritical();
+        return FALSE;
+    }
+
+    // insertion sort; less urgent frames move down, behind any frames of
+    // equal priority so that they go out in the order they were queued
+    for (index = can_tx_async_count; index > 0; index--) {
+        if (can_tx_key(can_tx_async_queue[index - 1].buf.id) > key) {
+            break;
+        }
+        can_tx_async_queue[index] = can_tx_async_queue[index - 1];
+    }
+    entry = &can_tx_async_queue[index];
+    entry->buf.id = id;
+    entry->buf.dlc = dlc;
+    for (i = 0; i < dlc; i++) {
+        entry->buf.data[i] = data[i];
+    }
+    entry->queued_ms = (uint16_t)timer_now_ms();
+    can_tx_async_count++;
+    can_tx_refill();
+
+    ExitCritical();
+    return TRUE;
+}
+
+bool
+can_tx_ordered(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    return can_tx_enqueue(&can_tx_ordered_lane, id, dlc, data);
+}
+
 void
-can_putchar(char ch)
+can_tx_blocking(uint32_t id, uint8_t dlc, const uint8_t *data)
 {
-    static uint8_t msg[8];
-    static uint8_t len = 0;
-    uint8_t ret;
+    if (dlc > 8) {
+        return;
+    }
+
+    /* wait for space in the ordered lane */
+    while (CAN_TX_FIFO_FULL(&can_tx_ordered_lane)) {
+    }
+    (void)can_tx_ordered(id, dlc, data);
+
+    /* and wait for it to be sent */
+    while (!CAN_TX_FIFO_EMPTY(&can_tx_ordered_lane) || !CAN_TX_FIFO_SENT(&can_tx_ordered_lane)) {
+    }
+}
+
+void
+can_tx_free(void)
+{
+    can_tx_refill();
+    pt_list_wake(&can_console_entry);
+    pt_list_signal(PT_EVENT_CAN_TX);
+}
+
+uint16_t
+can_tx_drop_count(void)
+{
+    return can_tx_drops;
+}
 
+uint8_t
+can_tx_ordered_space(void)
+{
+    return (uint8_t)(can_tx_ordered_lane.mask + 1 - (uint8_t)(can_tx_ordered_lane.head - can_tx_ordered_lane.tail));
+}
+
+const can_tx_latency_t *
+can_tx_latency(uint8_t priority_class)
+{
+    return &can_tx_latencies[priority_class];
+}
+
+/*
+ * Console output is buffered in a ring and sent by the console thread.
+ * A message ends after 8 characters or at a '\0' (newline); the
+ * producer counts complete messages so that partial lines are not sent
+ * early, and the consumer finds the message boundaries the same way.
+ */
+static uint8_t              can_console_ring[CAN_CONSOLE_BUFFER_SIZE];
+static uint8_t              can_console_head;
+static uint8_t              can_console_tail;
+static uint8_t              can_console_len;
+static volatile uint8_t     can_console_msgs;
+static uint16_t             can_console_overflows;
+#define _CAN_CONSOLE_INDEX(_x)  ((_x) & (uint8_t)(CAN_CONSOLE_BUFFER_SIZE - 1))
+#define CAN_CONSOLE_FULL        ((uint8_t)(can_console_head - can_console_tail) >= CAN_CONSOLE_BUFFER_SIZE)
+
+void
+can_putchar(char ch)
+{
     if (ch == '\n') {
         ch = '\0';
     }
-    msg[len++] = (uint8_t)ch;
-    if ((len == 8) || (ch == '\0')) {
-        do {
-            // send explicitly using buffer 0 to ensure messages are sent in order
-            ret = CAN1_SendFrame(0, CAN_EXTENDED_FRAME_ID | 0x1ffffffe, DATA_FRAME, len, &msg[0]);
-        } while (ret == ERR_TXFULL);
-        len = 0;
+    if (CAN_CONSOLE_FULL) {
+        can_console_overflows++;
+        return;
+    }
+    can_console_ring[_CAN_CONSOLE_INDEX(can_console_head)] = (uint8_t)ch;
+    can_console_head++;
+    if ((++can_console_len == 8) || (ch == '\0')) {
+        can_console_len = 0;
+        EnterCritical();
+        can_console_msgs++;
+        ExitCritical();
+        pt_list_wake(&can_console_entry);
     }
 }
 
-void
-can_tx_async(uint32_t id, uint8_t dlc, const uint8_t *data)
+/*
+ * Try to send the oldest complete console message.
+ */
+static bool
+can_console_send(void)
 {
-    uint8_t ret;
+    uint8_t msg[8];
+    uint8_t len = 0;
+    uint8_t index = can_console_tail;
 
+    if ((can_console_msgs == 0) || CAN_TX_FIFO_FULL(&can_tx_console_lane)) {
+        return FALSE;
+    }
     do {
-        ret = CAN1_SendFrameExt(id, DATA_FRAME, dlc, (byte *)data);
-    } while (ret == ERR_TXFULL);    
+        msg[len] = can_console_ring[_CAN_CONSOLE_INDEX(index++)];
+    } while ((msg[len++] != '\0') && (len < 8));
+
+    // the console lane keeps messages in order
+    if (!can_tx_enqueue(&can_tx_console_lane, CAN_EXTENDED_FRAME_ID | 0x1ffffffe, len, &msg[0])) {
+        return FALSE;
+    }
+    can_console_tail = index;
+    EnterCritical();
+    can_console_msgs--;
+    ExitCritical();
+    return TRUE;
+}
+
+static void
+can_console_thread(struct pt *pt)
+{
+    pt_begin(pt);
+
+    for (;;) {
+        // sleep until there is a complete message
+        pt_wait(pt, can_console_msgs > 0);
+
+        // send what we can, then wait for the transmitter to free up
+        // some space before coming back for the rest
+        while (can_console_send()) {
+        }
+        pt_wait(pt, !CAN_TX_FIFO_FULL(&can_tx_console_lane));
+    }
+    pt_end(pt);
 }
 
 void
-can_tx_ordered(uint32_t id, uint8_t dlc, const uint8_t *data)
+can_console_flush(void)
 {
-    uint8_t ret;
+    while (can_console_msgs > 0) {
+        (void)can_console_send();
+    }
+}
 
-    /* send explicitly using buffer 0 to ensure ordering */
-    do {
-        ret = CAN1_SendFrame(0, id, DATA_FRAME, dlc, (byte *)data);
-    } while (ret == ERR_TXFULL);    
+uint16_t
+can_console_overflow_count(void)
+{
+    return can_console_overflows;
+}
+
+/*
+ * Hardware acceptance filters.
+ *
+ * IDs registered with can_filter_add are converted to images of the
+ * MSCAN IDR0-3 registers (value and don't-care bits, packed into 32 bits)
+ * and then merged to fit the filters. The bootrom ID range always gets a
+ * filter of its own. Both the two-32-bit-filter and four-16-bit-filter
+ * configurations are tried and the one that lets the fewest unwanted IDs
+ * through is used; anything the hardware lets through that nobody asked
+ * for is left to app_can_filter.
+ */
+typedef struct {
+    uint32_t    value;
+    uint32_t    dontcare;
+} can_filter_t;
+
+static can_filter_t         can_filters[CAN_FILTER_MAX];
+static uint8_t              can_filter_count;
+static uint8_t              can_rate;
+
+static void                 can_filter_update(void);
+static timer_call_t         can_filter_call = {
+        { NULL, 0 },
+        can_filter_update,
+        0,
+        TIMER_CALL_THREAD
+};
+
+/*
+ * Convert an ID and care mask to an IDR image.
+ */
+static void
+can_filter_image(can_filter_t *filter, uint32_t id, uint32_t mask)
+{
+    if (id & CAN_EXTENDED_FRAME_ID) {
+        const uint32_t dc = ~mask & 0x1fffffffUL;
+
+        id &= 0x1fffffffUL;
+        filter->value = ((id >> 18) << 21)          /* ID28-18 */
+                        | (3UL << 19)               /* SRR, IDE */
+                        | ((id & 0x3ffffUL) << 1);  /* ID17-0 */
+        filter->dontcare = ((dc >> 18) << 21)
+                           | ((dc & 0x3ffffUL) << 1)
+                           | 1UL;                   /* RTR */
+    } else {
+        const uint32_t dc = ~mask & 0x7ffUL;
+
+        filter->value = (id & 0x7ffUL) << 21;       /* ID10-0, RTR = IDE = 0 */
+        filter->dontcare = (dc << 21)
+                           | (1UL << 20)            /* RTR */
+                           | (7UL << 16)            /* IDR1 2-0 unused */
+                           | 0xffffUL;              /* IDR2-3 unused */
+    }
+}
+
+/*
+ * Merge one filter into another, so that it accepts everything
+ * either of them did.
+ */
+static void
+can_filter_merge(can_filter_t *into, const can_filter_t *from)
+{
+    into->dontcare |= from->dontcare | (into->value ^ from->value);
+    into->value &= ~into->dontcare;
+}
+
+/*
+ * Count the don't-care bits in a filter.
+ */
+static uint8_t
+can_filter_width(const can_filter_t *filter)
+{
+    uint32_t dc = filter->dontcare;
+    uint8_t width = 0;
+
+    while (dc) {
+        width += (uint8_t)(dc & 1);
+        dc >>= 1;
+    }
+    return width;
+}
+
+/*
+ * Estimate how much of the ID space a set of filters lets through,
+ * as the sum of 2^width, saturating.
+ */
+static uint32_t
+can_filter_coverage(const can_filter_t *filters, uint8_t count)
+{
+    uint32_t coverage = 0;
+    uint8_t i;
+
+    for (i = 0; i < count; i++) {
+        const uint8_t width = can_filter_width(&filters[i]);
+        const uint32_t span = (width > 31) ? 0x80000000UL : (1UL << width);
+
+        coverage = (coverage > (0xffffffffUL - span)) ? 0xffffffffUL : (coverage + span);
+    }
+    return coverage;
+}
+
+/*
+ * Greedily merge filters until there are no more than max_filters,
+ * each time merging the pair that gives the narrowest result.
+ *
+ * If narrow is set the filters are first widened to 16-bit filters,
+ * which only look at IDR0-1.
+ */
+static void
+can_filter_reduce(can_filter_t *filters, uint8_t count, uint8_t max_filters, bool narrow)
+{
+    uint8_t i;
+    uint8_t j;
+
+    if (narrow) {
+        for (i = 0; i < count; i++) {
+            filters[i].dontcare |= 0xffffUL;
+            filters[i].value &= ~filters[i].dontcare;
+        }
+    }
+    while (count > max_filters) {
+        uint8_t best_i = 0;
+        uint8_t best_j = 1;
+        uint8_t best_width = 0xff;
+
+        for (i = 0; i < count; i++) {
+            for (j = i + 1; j < count; j++) {
+                can_filter_t merged = filters[i];
+                uint8_t width;
+
+                can_filter_merge(&merged, &filters[j]);
+                width = can_filter_width(&merged);
+                if (width < best_width) {
+                    best_width = width;
+                    best_i = i;
+                    best_j = j;
+                }
+            }
+        }
+        can_filter_merge(&filters[best_i], &filters[best_j]);
+        filters[best_j] = filters[--count];
+    }
+}
+
+/*
+ * Write an IDR image to a filter's acceptance and mask registers.
+ */
+static void
+can_filter_write(volatile uint8_t *idar, volatile uint8_t *idmr, const can_filter_t *filter, uint8_t len)
+{
+    uint8_t i;
+
+    for (i = 0; i < len; i++) {
+        idar[i] = (uint8_t)(filter->value >> (24 - 8 * i));
+        idmr[i] = (uint8_t)(filter->dontcare >> (24 - 8 * i));
+    }
+}
+
+/*
+ * Program the acceptance filters.
+ *
+ * Must be called in initialization mode.
+ */
+static void
+can_filter_apply(void)
+{
+    static can_filter_t wide[2];
+    static can_filter_t narrow[CAN_FILTER_MAX + 1];
+    uint8_t narrow_count;
+    uint8_t i;
+
+    // filter 0 is always the bootrom
+    can_filter_image(&wide[0], CAN_EXTENDED_FRAME_ID | MRS_ID_MASK, MRS_ID_MASK);
+
+    // nothing registered, accept everything
+    if (can_filter_count == 0) {
+        wide[1].value = 0;
+        wide[1].dontcare = 0xffffffffUL;
+        CANIDAC = 0x00;
+        can_filter_write(&CANIDAR0, &CANIDMR0, &wide[0], 4);
+        can_filter_write(&CANIDAR4, &CANIDMR4, &wide[1], 4);
+        return;
+    }
+
+    // two 32-bit filters; everything registered shares the second
+    wide[1] = can_filters[0];
+    for (i = 1; i < can_filter_count; i++) {
+        can_filter_merge(&wide[1], &can_filters[i]);
+    }
+
+    // four 16-bit filters; registrations are clustered into the last three
+    narrow[0] = wide[0];
+    for (i = 0; i < can_filter_count; i++) {
+        narrow[i + 1] = can_filters[i];
+    }
+    narrow_count = (uint8_t)(can_filter_count + 1);
+    can_filter_reduce(narrow, 1, 1, TRUE);
+    can_filter_reduce(&narrow[1], can_filter_count, 3, TRUE);
+    if (narrow_count > 4) {
+        narrow_count = 4;
+    }
+
+    if (can_filter_coverage(wide, 2) <= can_filter_coverage(narrow, narrow_count)) {
+        CANIDAC = 0x00;
+        can_filter_write(&CANIDAR0, &CANIDMR0, &wide[0], 4);
+        can_filter_write(&CANIDAR4, &CANIDMR4, &wide[1], 4);
+    } else {
+        // spare filters repeat the bootrom filter
+        for (i = narrow_count; i < 4; i++) {
+            narrow[i] = narrow[0];
+        }
+        CANIDAC = 0x10;
+        can_filter_write(&CANIDAR0, &CANIDMR0, &narrow[0], 2);
+        can_filter_write(&CANIDAR2, &CANIDMR2, &narrow[1], 2);
+        can_filter_write(&CANIDAR4, &CANIDMR4, &narrow[2], 2);
+        can_filter_write(&CANIDAR6, &CANIDMR6, &narrow[3], 2);
+    }
 }
 
 void
-can_tx_blocking(uint32_t id, uint8_t dlc, const uint8_t *data)
+can_filter_add(uint32_t id, uint32_t mask)
+{
+    REQUIRE(can_filter_count < CAN_FILTER_MAX);
+
+    can_filter_image(&can_filters[can_filter_count++], id, mask);
+
+    // if the controller is already running, reprogram it once this
+    // batch of registrations is done
+    if (can_rate != 0) {
+        timer_call_reset(can_filter_call, 1);
+    }
+}
+
+/*
+ * Reprogram the filters on a running controller.
+ *
+ * Entering initialization mode aborts anything in the transmit buffers,
+ * so wait for them to empty first; the receive FIFOs and the transmit
+ * queues are left alone, unlike can_reinit.
+ */
+static void
+can_filter_update(void)
+{
+    EnterCritical();
+
+    if ((CANTFLG & CAN_TX_BUFFERS) != CAN_TX_BUFFERS) {
+        ExitCritical();
+        timer_call_reset(can_filter_call, 1);
+        return;
+    }
+
+    CANCTL0 |= CANCTL0_INITRQ_MASK;
+    while (!(CANCTL1 & CANCTL1_INITAK_MASK)) {
+    }
+    can_filter_apply();
+    CANCTL0 &= (uint8_t)~CANCTL0_INITRQ_MASK;
+    while (CANCTL1 & CANCTL1_INITAK_MASK) {
+    }
+
+    // interrupt enables were held in reset
+    CANRIER = 0x45;
+    can_tx_refill();
+
+    ExitCritical();
+}
+
+/*
+ * Receive dispatch table.
+ *
+ * Each registration covers a contiguous range of IDs; the table is kept
+ * sorted by the start of the range so that a frame can be matched with
+ * a binary search, both in the interrupt handler when deciding whether
+ * to keep it and on the listener thread when dispatching it.
+ */
+typedef struct {
+    uint32_t            first;              // first ID in the range, CAN_EXTENDED_FRAME_ID for 29-bit
+    uint32_t            last;               // last ID in the range
+    can_rx_handler_t    handler;            // thread handler, or NULL
+    void                *ctx;
+    can_rx_isr_t        *isr;               // interrupt handler, or NULL
+} can_rx_entry_t;
+
+static can_rx_entry_t       can_rx_table[CAN_RX_HANDLER_MAX];
+static uint8_t              can_rx_table_count;
+static uint16_t             can_rx_unclaimed;
+#ifdef CONFIG_CAN_RX_ISR_CHECK
+static can_rx_isr_t         *can_rx_isr_overrun;  // most recent handler to overrun, for reporting
+#endif
+
+/*
+ * Find the handler for an ID, or NULL if there isn't one.
+ */
+static const can_rx_entry_t *
+can_rx_lookup(uint32_t id)
 {
-    can_tx_ordered(id, dlc, data);
+    uint8_t lo = 0;
+    uint8_t hi = can_rx_table_count;
+
+    // find the last entry starting at or below the ID
+    while (lo < hi) {
+        const uint8_t mid = (uint8_t)((lo + hi) / 2);
 
-    /* and wait for buffer 0 to be done */
-    while (CAN1_GetStateTX() ^ 0x01) {}
+        if (can_rx_table[mid].first <= id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if ((lo > 0) && (id <= can_rx_table[lo - 1].last)) {
+        return &can_rx_table[lo - 1];
+    }
+    return NULL;
+}
+
+/*
+ * Add an ID range to the dispatch table.
+ */
+static void
+can_rx_table_insert(uint32_t id, uint32_t mask, can_rx_handler_t handler, void *ctx, can_rx_isr_t *isr)
+{
+    const uint32_t id_bits = (id & CAN_EXTENDED_FRAME_ID) ? 0x1fffffffUL : 0x7ffUL;
+    const uint32_t span = ~mask & id_bits;
+    const uint32_t first = (id & ~span & (id_bits | CAN_EXTENDED_FRAME_ID));
+    const uint32_t last = first | span;
+    uint8_t i;
+
+    REQUIRE(can_rx_table_count < CAN_RX_HANDLER_MAX);
+    REQUIRE((span & (span + 1)) == 0);          // mask must cover the upper bits
+
+    // find the insertion point, and make sure we don't overlap a neighbour
+    for (i = can_rx_table_count; i > 0; i--) {
+        if (can_rx_table[i - 1].first < first) {
+            break;
+        }
+    }
+    REQUIRE((i == 0) || (can_rx_table[i - 1].last < first));
+    REQUIRE((i == can_rx_table_count) || (can_rx_table[i].first > last));
+
+    // the ISR searches the table, so update it with interrupts off
+    EnterCritical();
+    {
+        uint8_t j;
+
+        for (j = can_rx_table_count; j > i; j--) {
+            can_rx_table[j] = can_rx_table[j - 1];
+        }
+        can_rx_table[i].first = first;
+        can_rx_table[i].last = last;
+        can_rx_table[i].handler = handler;
+        can_rx_table[i].ctx = ctx;
+        can_rx_table[i].isr = isr;
+        can_rx_table_count++;
+    }
+    ExitCritical();
+
+    can_filter_add(id, mask);
+}
+
+void
+can_rx_register(uint32_t id, uint32_t mask, can_rx_handler_t handler, void *ctx)
+{
+    can_rx_table_insert(id, mask, handler, ctx, NULL);
+}
+
+void
+can_rx_register_isr(uint32_t id, uint32_t mask, can_rx_isr_t *isr)
+{
+    can_rx_table_insert(id, mask, NULL, NULL, isr);
+}
+
+/*
+ * Run an interrupt-time handler.
+ */
+static void
+can_rx_isr_run(can_rx_isr_t *isr, const can_buf_t *buf)
+{
+#ifdef CONFIG_CAN_RX_ISR_CHECK
+    const uint16_t started = timer_counter();
+    uint16_t counts;
+
+    isr->handler(buf, isr->ctx);
+
+    counts = timer_counter_elapsed(started);
+    if (counts > isr->max_counts) {
+        isr->max_counts = counts;
+    }
+    if (counts > isr->budget_counts) {
+        if (isr->overruns < 0xffff) {
+            isr->overruns++;
+        }
+        // have the listener thread report it
+        can_rx_isr_overrun = isr;
+        pt_list_signal(PT_EVENT_CAN_RX);
+    }
+#else
+    isr->handler(buf, isr->ctx);
+#endif
+}
+
+uint16_t
+can_rx_unclaimed_count(void)
+{
+    return can_rx_unclaimed;
 }
 
 /*
@@ -92,6 +865,8 @@ can_tx_blocking(uint32_t id, uint8_t dlc, const uint8_t *data)
 void
 can_reinit(uint8_t rate)
 {
+    uint8_t i;
+
     /* Switch to initialization mode. */
     CANCTL0 |= CANCTL0_INITRQ_MASK;
     while (!(CANCTL1 & CANCTL1_INITAK_MASK)) {
@@ -125,44 +900,225 @@ can_reinit(uint8_t rate)
         break;
     }
 
-    /* 
-     * XXX TODO Give the application a chance to tinker with the filters,
-     *     but make sure that it can't disable the bootrom ID.
-     */
+    /* Configure the acceptance filters; always includes the bootrom ID. */
+    can_filter_apply();
+    can_rate = rate;
 
     /* clear INITRQ and wait for it to be acknowledged */
     CANCTL0 ^= CANCTL0_INITRQ_MASK;
     while (CANCTL1 & CANCTL1_INITAK_MASK) {
     }
     CANRFLG |= 0xFE;                     /* Reset error flags */
-    CANRIER = 0x01;                      /* Enable interrupts */
+    CANRIER = 0x45;                      /* Enable RX and bus-off interrupts */
+
+    /* clear the FIFOs */
+    for (i = 0; i < CAN_RX_LANES; i++) {
+        can_rx_fifo[i].head = 0;
+        can_rx_fifo[i].tail = 0;
+    }
 
-    /* clear the FIFO */
-    can_buf_head = 0;
-    can_buf_tail = 0;
+    /* start collecting statistics */
+    can_stats_init(rate);
+
+    /* start watching for bus-off */
+    can_error_init();
+
+    /* start the console thread */
+    pt_list_register(&can_console_entry);
 
     // now we can enable RX events
     CAN1_EnableEvent();
 }
 
 /*
- * Interrupt callback for CAN receive.
+ * Count a frame that no handler wants, and let the application decide
+ * whether to keep it.
  */
-void
-can_rx_message(void)
+static bool
+can_rx_unclaimed_filter(can_buf_t *buf)
+{
+    if (can_rx_unclaimed < 0xffff) {
+        can_rx_unclaimed++;
+    }
+    return app_can_filter(buf);
+}
+
+/*
+ * Choose the receive FIFO for an ID.
+ */
+static can_rx_fifo_t *
+can_rx_lane(uint32_t id)
+{
+    if ((id & MRS_ID_MASK) == MRS_ID_MASK) {
+        return &can_rx_fifo[CAN_RX_LANE_BOOTROM];
+    }
+    if (!(id & CAN_EXTENDED_FRAME_ID) && (id < CAN_RX_HIGH_ID_LIMIT)) {
+        return &can_rx_fifo[CAN_RX_LANE_HIGH];
+    }
+    return &can_rx_fifo[CAN_RX_LANE_LOW];
+}
+
+/*
+ * Decide whether a frame should be queued.
+ */
+static bool
+can_rx_wanted(const can_rx_fifo_t *fifo, can_buf_t *buf)
 {
-    // check for a CAN message
+    const can_rx_entry_t *entry;
+
+    if (fifo == &can_rx_fifo[CAN_RX_LANE_BOOTROM]) {
+        return TRUE;
+    }
+    entry = can_rx_lookup(buf->id);
+    if (entry == NULL) {
+        return can_rx_unclaimed_filter(buf);
+    }
+    if (entry->isr != NULL) {
+        // handled here and now
+        can_rx_isr_run(entry->isr, buf);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/*
+ * Count a frame dropped because its FIFO was full.
+ */
+static void
+can_rx_overflow(can_rx_fifo_t *fifo)
+{
+    if (fifo->overflows < 0xffff) {
+        fifo->overflows++;
+    }
+    can_trace(TRACE_CAN_IROVF);
+}
+
+/*
+ * Queue the frame in the slot at the head of a FIFO.
+ */
+static void
+can_rx_commit(can_rx_fifo_t *fifo)
+{
+    uint8_t depth;
+
+    fifo->head++;
+    depth = (uint8_t)(fifo->head - fifo->tail);
+    if (depth > fifo->max_depth) {
+        fifo->max_depth = depth;
+    }
+    can_trace(TRACE_CAN_IRX);
+    pt_list_signal(PT_EVENT_CAN_RX);
+}
+
+#ifdef CONFIG_CAN_RX_DIRECT
+/*
+ * Decode the ID from an MSCAN identifier register image into the same
+ * format as CAN1_ReadFrame produces.
+ *
+ * Returns FALSE for a remote frame.
+ */
+static bool
+can_rx_decode_id(const volatile uint8_t *idr, uint32_t *id)
+{
+    const uint8_t idr1 = idr[1];
+
+    if (idr1 & 0x08) {
+        // IDE set, 29-bit ID
+        if (idr[3] & 0x01) {
+            return FALSE;
+        }
+        *id = CAN_EXTENDED_FRAME_ID
+              | ((uint32_t)idr[0] << 21)                        /* ID28-21 */
+              | ((uint32_t)(idr1 & 0xe0) << 13)                 /* ID20-18 */
+              | ((uint32_t)(idr1 & 0x07) << 15)                 /* ID17-15 */
+              | ((uint16_t)idr[2] << 7)                         /* ID14-7 */
+              | (idr[3] >> 1);                                  /* ID6-0 */
+    } else {
+        // 11-bit ID
+        if (idr1 & 0x10) {
+            return FALSE;
+        }
+        *id = ((uint16_t)idr[0] << 3) | (idr1 >> 5);
+    }
+    return TRUE;
+}
+
+/*
+ * Receive a frame by decoding the MSCAN receive buffer straight into
+ * its FIFO slot.
+ *
+ * The ID is in the same format as CAN1_ReadFrame produces.
+ */
+static void
+can_rx_direct(void)
+{
+    can_rx_fifo_t *fifo;
     can_buf_t *buf;
+    uint32_t id;
+    uint8_t dlc;
+    uint8_t i;
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+    // stamp the frame before anything else adds latency
+    const uint16_t rx_counter = timer_counter();
+    const uint16_t rx_ms = (uint16_t)timer_now_ms();
+#endif
+
+    // ignore remote frames
+    if (!can_rx_decode_id(&CANRIDR0, &id)) {
+        CANRFLG = CANRFLG_RXF_MASK;
+        return;
+    }
+
+    // decode into the FIFO slot, or the scratch buffer if the FIFO is full
+    // so that the frame can still be filtered before counting the overflow
+    fifo = can_rx_lane(id);
+    buf = CAN_RX_FIFO_FULL(fifo) ? &can_rx_scratch : CAN_RX_FIFO_PTR(fifo, fifo->head);
+    buf->id = id;
+    dlc = CANRDLR & 0x0f;
+    if (dlc > 8) {
+        dlc = 8;
+    }
+    buf->dlc = dlc;
+    for (i = 0; i < dlc; i++) {
+        buf->data[i] = (&CANRDSR0)[i];
+    }
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+    buf->rx_counter = rx_counter;
+    buf->rx_ms = rx_ms;
+#endif
+
+    // release the receive buffer
+    CANRFLG = CANRFLG_RXF_MASK;
+
+    can_stats_rx_frame(buf);
+    if (!can_rx_wanted(fifo, buf)) {
+        return;
+    }
+    if (buf == &can_rx_scratch) {
+        can_rx_overflow(fifo);
+        return;
+    }
+    can_rx_commit(fifo);
+}
+#else
+/*
+ * Receive a frame using the Processor Expert driver, then copy it
+ * into its FIFO slot.
+ */
+static void
+can_rx_read_frame(void)
+{
+    can_buf_t *buf = &can_rx_scratch;
+    can_rx_fifo_t *fifo;
     uint8_t type;
     uint8_t ret;
     uint8_t format;
 
-    // If there's nowhere to put a message, just drop it.
-    if (CAN_BUF_FULL) {
-        can_trace(TRACE_CAN_IROVF);
-        return;
-    }
-    buf = CAN_BUF_PTR(can_buf_head);
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+    // stamp the frame before anything else adds latency
+    buf->rx_counter = timer_counter();
+    buf->rx_ms = (uint16_t)timer_now_ms();
+#endif
 
     // read the frame
     ret = CAN1_ReadFrame(&buf->id,
@@ -171,28 +1127,109 @@ can_rx_message(void)
                          &buf->dlc,
                          &buf->data[0]);
 
-    if ((ret == ERR_OK) &&
-            (type == DATA_FRAME)) {
+    if ((ret != ERR_OK) || (type != DATA_FRAME)) {
+        return;
+    }
+    can_stats_rx_frame(buf);
 
-        if (((buf->id & MRS_ID_MASK) == MRS_ID_MASK) || app_can_filter(buf)) {
-            // accept this message
-            can_buf_head++;
-            can_trace(TRACE_CAN_IRX);
+    fifo = can_rx_lane(buf->id);
+    if (!can_rx_wanted(fifo, buf)) {
+        return;
+    }
+
+    // If there's nowhere to put the message, just drop it.
+    if (CAN_RX_FIFO_FULL(fifo)) {
+        can_rx_overflow(fifo);
+        return;
+    }
+
+    // accept this message
+    *CAN_RX_FIFO_PTR(fifo, fifo->head) = *buf;
+    can_rx_commit(fifo);
+}
+#endif // CONFIG_CAN_RX_DIRECT
+
+/*
+ * Interrupt callback for CAN receive.
+ */
+void
+can_rx_message(void)
+{
+#ifdef CONFIG_CAN_RX_DIRECT
+    pt_profile(&pt_profile_can_rx, can_rx_direct());
+#else
+    pt_profile(&pt_profile_can_rx, can_rx_read_frame());
+#endif
+}
+
+uint16_t
+can_rx_overflow_count(uint8_t lane)
+{
+    REQUIRE(lane < CAN_RX_LANES);
+
+    return can_rx_fifo[lane].overflows;
+}
+
+uint8_t
+can_rx_max_depth(uint8_t lane)
+{
+    REQUIRE(lane < CAN_RX_LANES);
+
+    return can_rx_fifo[lane].max_depth;
+}
+
+uint16_t
+can_listen_budget_hits(void)
+{
+    return can_listen_budget_hit_count;
+}
+
+/*
+ * Find the most urgent non-empty receive FIFO.
+ */
+static can_rx_fifo_t *
+can_rx_next_fifo(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < CAN_RX_LANES; i++) {
+        if (!CAN_RX_FIFO_EMPTY(&can_rx_fifo[i])) {
+            return &can_rx_fifo[i];
         }
     }
+    return NULL;
 }
 
 can_buf_t *
 can_buf_peek(void)
 {
-    return CAN_BUF_EMPTY ? NULL : CAN_BUF_PTR(can_buf_tail);
+    can_rx_fifo_t *fifo = can_rx_next_fifo();
+
+    return (fifo == NULL) ? NULL : CAN_RX_FIFO_PTR(fifo, fifo->tail);
+}
+
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+uint16_t
+can_buf_age_ms(const can_buf_t *buf)
+{
+    return (uint16_t)timer_now_ms() - buf->rx_ms;
 }
+#endif
 
 void
-can_buf_drop(void)
+can_buf_drop(const can_buf_t *buf)
 {
-    if (!CAN_BUF_EMPTY) {
-        can_buf_tail++;
+    uint8_t i;
+
+    // a more urgent frame may have arrived since the peek, so drop from
+    // the FIFO that buf came from rather than the most urgent one
+    for (i = 0; i < CAN_RX_LANES; i++) {
+        can_rx_fifo_t *fifo = &can_rx_fifo[i];
+
+        if (!CAN_RX_FIFO_EMPTY(fifo) && (CAN_RX_FIFO_PTR(fifo, fifo->tail) == buf)) {
+            fifo->tail++;
+            break;
+        }
     }
 }
 
@@ -201,7 +1238,10 @@ can_listen(struct pt *pt)
 {
     static timer_t  can_idle_timer;
     static bool     can_idle_flag = FALSE;
-    uint8_t limit;
+    can_rx_fifo_t *fifo;
+    const can_rx_entry_t *entry;
+    uint32_t spent;
+    uint32_t start_ms;
 
 
     pt_begin(pt);
@@ -211,12 +1251,31 @@ can_listen(struct pt *pt)
     timer_reset(can_idle_timer, CAN_IDLE_TIMEOUT);
 
     for (;;) {
-        // Limit the number of messages that will be processed to avoid watchdogging
-        // during a message storm.
-        limit = CAN_RX_FIFO_SIZE;
+#ifdef CONFIG_CAN_RX_ISR_CHECK
+        if (can_rx_isr_overrun != NULL) {
+            can_rx_isr_t *isr = can_rx_isr_overrun;
+
+            can_rx_isr_overrun = NULL;
+            print("CAN ISR handler %p over budget: %u > %u",
+                  (const void *)isr->handler,
+                  isr->max_counts,
+                  isr->budget_counts);
+        }
+#endif
+
+        // Limit the time spent processing messages to avoid watchdogging
+        // during a message storm. The counter wraps every tick, so time is
+        // accumulated a message at a time; the millisecond clock catches
+        // handlers that run for longer than that.
+        spent = 0;
+        start_ms = timer_now_ms();
+
+        // re-check the lanes after every message so that a bootrom or
+        // high-priority frame arriving mid-pass is handled next
+        while ((fifo = can_rx_next_fifo()) != NULL) {
+            can_buf_t *buf = CAN_RX_FIFO_PTR(fifo, fifo->tail);
+            const uint16_t started = timer_counter();
 
-        while (!CAN_BUF_EMPTY && limit--) {
-            can_buf_t *buf = CAN_BUF_PTR(can_buf_tail);
             can_trace(TRACE_CAN_TRX);
 
             // We're hearing CAN, so reset the idle timer and let the app know.
@@ -227,20 +1286,33 @@ can_listen(struct pt *pt)
             }
 
             // Handle MRS flasher messages directly.
-            if ((buf->id & MRS_ID_MASK) == MRS_ID_MASK) {
+            if (fifo == &can_rx_fifo[CAN_RX_LANE_BOOTROM]) {
                 can_trace(TRACE_CAN_MRS_RX);
                 if (mrs_bootrom_rx(buf)) {
                 	goto handled;
                 }
             }
 
-            // Pass the message to the application.
-			can_trace(TRACE_CAN_APP_RX);
-			app_can_receive(buf);
+            // Pass the message to its handler, or to the application.
+            entry = can_rx_lookup(buf->id);
+            if ((entry != NULL) && (entry->handler != NULL)) {
+                entry->handler(buf, entry->ctx);
+            } else {
+                can_trace(TRACE_CAN_APP_RX);
+                app_can_receive(buf);
+            }
 
 handled:
             // mark the slot as free
-            can_buf_tail++;
+            fifo->tail++;
+
+            spent += timer_counter_elapsed(started);
+            if ((spent >= CAN_LISTEN_BUDGET) || ((timer_now_ms() - start_ms) > 1)) {
+                if ((can_rx_next_fifo() != NULL) && (can_listen_budget_hit_count < 0xffff)) {
+                    can_listen_budget_hit_count++;
+                }
+                break;
+            }
         }
 
         // if we haven't heard a useful CAN message for a while...
@@ -249,7 +1321,13 @@ handled:
             app_can_idle(TRUE);
         }
 
-        pt_yield(pt);
+        if (can_rx_next_fifo() == NULL) {
+            // sleep until a message arrives or the idle timer expires
+            pt_wait(pt, (can_rx_next_fifo() != NULL) || (!can_idle_flag && timer_expired(can_idle_timer)));
+        } else {
+            // out of time, give other threads a chance to run
+            pt_yield(pt);
+        }
     }
     pt_end(pt);
 }
@@ -5,15 +5,27 @@
 #ifndef CORE_CAN_H_
 #define CORE_CAN_H_
 
+#include <config.h>
+
 #include <core/lib.h>
+#include <core/pt.h>
 
 /**
  * CAN message structure.
+ *
+ * With CONFIG_CAN_RX_TIMESTAMP, received messages are stamped in the
+ * receive interrupt with the low 16 bits of timer_now_ms() and the
+ * timer_counter() value, which together give sub-millisecond arrival
+ * times. The fields are not used for transmit.
  */
 typedef struct {
     uint32_t    id;
     uint8_t     dlc;
     uint8_t     data[8];
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+    uint16_t    rx_ms;
+    uint16_t    rx_counter;
+#endif
 } can_buf_t;
 
 /** set this bit in the id field to send a 29-bit id */
@@ -50,25 +62,42 @@ extern void _can_trace(uint8_t code);
 /**
  * Adds a single character to the CAN console buffer.
  * 
- * If the character is '\n', or the buffer is full, a
- * console message will be sent.
+ * If the character is '\n', or the message is full, the
+ * console thread will send a console message.
+ * 
+ * Never blocks; if the buffer is full the character is dropped and
+ * counted. Not interrupt-safe.
  * 
  * @param ch		The character to add.
  */
 extern void can_putchar(char ch);
 
+/**
+ * Wait until all complete console messages have been sent.
+ */
+extern void can_console_flush(void);
+
+/**
+ * Get the number of console characters dropped because the
+ * buffer was full.
+ */
+extern uint16_t can_console_overflow_count(void);
+
 /**
  * Send a CAN message.
  *
- * Returns as soon as the message has been queued in
- * any transmit slot. Messages queued with this interface
- * may not be transmitted in order.
+ * Queues the message and returns immediately. Messages 
+ * queued with this interface are sent most urgent (lowest
+ * CAN ID) first, and may not be transmitted in order.
  * 
  * @param id        Message ID
  * @param dlc       Message data length
  * @param data      Message data
+ * @return          TRUE if the message was queued, FALSE if the
+ *                  queue was full and the message was dropped, or
+ *                  dlc was more than 8.
  */
-extern void can_tx_async(uint32_t id,
+extern bool can_tx_async(uint32_t id,
                          uint8_t dlc,
                          const uint8_t *data);
 
@@ -76,29 +105,169 @@ extern void can_tx_async(uint32_t id,
  * Send a CAN message, explicitly ordered against other 
  * messages sent with this interface.
  * 
- * Returns once the message is queued for transmission;
- * will wait until any other message queued by this 
- * API has been sent.
+ * Queues the message and returns immediately; messages
+ * queued with this interface are sent in the order they
+ * were queued.
  * 
  * @param id        Message ID
  * @param dlc       Message data length
  * @param data      Message data
+ * @return          TRUE if the message was queued, FALSE if the
+ *                  queue was full and the message was dropped, or
+ *                  dlc was more than 8.
  */
-extern void can_tx_ordered(uint32_t id,
+extern bool can_tx_ordered(uint32_t id,
                            uint8_t dlc,
                            const uint8_t *data);
 
+/**
+ * Get the number of free slots in the can_tx_ordered queue.
+ *
+ * Lets bulk senders pace themselves rather than having messages
+ * dropped; a thread can wait for space with PT_EVENT_CAN_TX in its
+ * wake events.
+ */
+extern uint8_t can_tx_ordered_space(void);
+
 /**
  * Send a CAN message and wait for it to be sent.
  * 
+ * Ordered with respect to can_tx_ordered.
+ * 
  * @param id        Message ID
- * @param dlc       Message data length
+ * @param dlc       Message data length; nothing is sent if more than 8
  * @param data      Message data
  */
 extern void can_tx_blocking(uint32_t id,
                             uint8_t dlc,
                             const uint8_t *data);
 
+/**
+ * Interrupt callback; refills the transmit buffers from the
+ * software queues, and signals PT_EVENT_CAN_TX for threads waiting
+ * for queue space.
+ */
+extern void can_tx_free(void);
+
+/**
+ * Get the number of messages dropped because a transmit queue
+ * was full.
+ */
+extern uint16_t can_tx_drop_count(void);
+
+/**
+ * Transmit queueing latency statistics.
+ * 
+ * Frames are divided into classes by the top two bits of their
+ * (base) ID, so class 0 is the most urgent.
+ */
+typedef struct {
+    uint16_t    frames;
+    uint16_t    max_ms;
+    uint32_t    total_ms;
+} can_tx_latency_t;
+
+#define CAN_TX_PRIORITY_CLASSES     4
+
+/**
+ * Get the queueing latency statistics for a priority class.
+ * 
+ * @param priority_class    0 - CAN_TX_PRIORITY_CLASSES-1
+ * @return                  Pointer to the statistics, which are
+ *                          updated at interrupt time.
+ */
+extern const can_tx_latency_t *can_tx_latency(uint8_t priority_class);
+
+/**
+ * Ask for a range of IDs to be accepted by the hardware filters.
+ *
+ * Once anything has been registered, only registered IDs (and the
+ * bootrom IDs, which are always accepted) are received; app_can_filter
+ * is still called for every frame and should reject anything the
+ * hardware could not filter out. With nothing registered every frame
+ * is received.
+ *
+ * Should be called during initialisation; if the controller is already
+ * running, the new filters are applied shortly afterwards, once for any
+ * number of registrations made together, without disturbing the
+ * receive and transmit queues.
+ *
+ * @param id        The ID to accept; include CAN_EXTENDED_FRAME_ID for
+ *                  a 29-bit ID.
+ * @param mask      ID bits that must match, e.g. 0x7ff for just this ID.
+ */
+extern void can_filter_add(uint32_t id, uint32_t mask);
+
+/**
+ * CAN receive handler.
+ *
+ * Called on the CAN listener thread for each received frame that
+ * matches the handler's registration.
+ *
+ * @param buf       CAN message.
+ * @param ctx       The context pointer passed to can_rx_register.
+ */
+typedef void (*can_rx_handler_t)(can_buf_t *buf, void *ctx);
+
+/**
+ * Register a handler for a range of IDs.
+ *
+ * The range is also passed to can_filter_add, and matching frames are
+ * queued without consulting app_can_filter. Frames that match no handler
+ * go to app_can_filter and app_can_receive as before.
+ *
+ * Lookup is a binary search, so the mask must select the upper bits of
+ * the ID (e.g. 0x780 or 0x7ff, not 0x0ff) and ranges must not overlap.
+ *
+ * @param id        The ID to accept; include CAN_EXTENDED_FRAME_ID for
+ *                  a 29-bit ID.
+ * @param mask      ID bits that must match.
+ * @param handler   Function to call for matching frames.
+ * @param ctx       Passed to the handler.
+ */
+extern void can_rx_register(uint32_t id, uint32_t mask, can_rx_handler_t handler, void *ctx);
+
+/**
+ * Interrupt-time CAN receive handler.
+ *
+ * For time-critical commands; the handler is called from the receive
+ * interrupt as soon as a matching frame arrives, and the frame is not
+ * queued. Handlers must be short and interrupt-safe.
+ *
+ * budget_counts is the handler's declared worst-case run time in
+ * timer_counter() counts. With CONFIG_CAN_RX_ISR_CHECK every call is
+ * timed; runs over budget are counted in overruns and reported on the
+ * console by the listener thread.
+ */
+typedef struct {
+    void                (*handler)(const can_buf_t *buf, void *ctx);
+    void                *ctx;
+    uint16_t            budget_counts;
+    uint16_t            max_counts;         // longest run, CONFIG_CAN_RX_ISR_CHECK only
+    uint16_t            overruns;           // runs over budget, CONFIG_CAN_RX_ISR_CHECK only
+} can_rx_isr_t;
+
+/**
+ * Register an interrupt-time handler for a range of IDs.
+ *
+ * As for can_rx_register, but the handler is called from the receive
+ * interrupt. Handlers and ranges share one table, so the ranges must
+ * not overlap those of other handlers.
+ *
+ * @param id        The ID to accept; include CAN_EXTENDED_FRAME_ID for
+ *                  a 29-bit ID.
+ * @param mask      ID bits that must match.
+ * @param isr       The handler, which must remain valid.
+ */
+extern void can_rx_register_isr(uint32_t id, uint32_t mask, can_rx_isr_t *isr);
+
+/**
+ * Count of received frames that matched no registered handler.
+ *
+ * @return          The number of frames, saturating.
+ */
+extern uint16_t can_rx_unclaimed_count(void);
+
 /**
  * (Re)configure the CAN hardware.
  * 
@@ -108,20 +277,55 @@ extern void can_tx_blocking(uint32_t id,
 extern void can_reinit(uint8_t speed);
 
 /**
- * Interrupt callback; copies CAN messages into the RX FIFO.
+ * Interrupt callback; copies CAN messages into the RX FIFOs.
  */
 extern void can_rx_message(void);
 
 /**
- * CAN listener thread. Call this periodically to process the
- * RX FIFO.
+ * CAN listener thread. Register this on the thread list with
+ * PT_EVENT_CAN_RX | PT_EVENT_TIMER wake events to process the
+ * RX FIFOs; bootrom frames are handled first, then high-priority
+ * and finally low-priority application frames.
  * 
  * @param pt		Callback protothread.
  */
 extern void can_listen(struct pt *pt);
 
 /**
- * Get a pointer to the oldest message in the CAN receive FIFO.
+ * CAN receive FIFOs, in the order they are drained.
+ */
+#define CAN_RX_LANE_BOOTROM     0
+#define CAN_RX_LANE_HIGH        1
+#define CAN_RX_LANE_LOW         2
+#define CAN_RX_LANES            3
+
+/**
+ * Count of frames dropped because a receive FIFO was full.
+ *
+ * @param lane      One of the CAN_RX_LANE_* constants.
+ * @return          The number of frames dropped, saturating.
+ */
+extern uint16_t can_rx_overflow_count(uint8_t lane);
+
+/**
+ * Deepest a receive FIFO has been since startup.
+ *
+ * @param lane      One of the CAN_RX_LANE_* constants.
+ * @return          The largest number of frames seen waiting in the FIFO.
+ */
+extern uint8_t can_rx_max_depth(uint8_t lane);
+
+/**
+ * Count of can_listen passes that ran out of time with frames still
+ * waiting; see CAN_LISTEN_BUDGET.
+ *
+ * @return          The number of passes, saturating at 65535.
+ */
+extern uint16_t can_listen_budget_hits(void);
+
+/**
+ * Get a pointer to the oldest, most urgent message in the CAN
+ * receive FIFOs.
  * 
  * Use this in conjunction with can_buf_drop() if not using the
  * can_listen protothread.
@@ -131,12 +335,28 @@ extern void can_listen(struct pt *pt);
  */
 extern can_buf_t *can_buf_peek(void);
 
+#ifdef CONFIG_CAN_RX_TIMESTAMP
+/**
+ * Get the time since a received message arrived.
+ *
+ * Useful for measuring handling latency and for discarding stale
+ * messages after a backlog.
+ *
+ * @param buf       A received CAN message.
+ * @return          Milliseconds since the message was received.
+ */
+extern uint16_t can_buf_age_ms(const can_buf_t *buf);
+#endif
+
 /**
- * Drop the oldest message from the CAN receive FIFO.
+ * Drop the message returned by can_buf_peek().
  * 
- * Does nothing if the FIFO is empty.
+ * Drops that message even if a more urgent one has arrived since.
+ * Does nothing if it is no longer queued.
+ *
+ * @param buf       The message returned by can_buf_peek().
  */
-extern void can_buf_drop(void);
+extern void can_buf_drop(const can_buf_t *buf);
 
 
 #endif /* CAN_H_ */
@@ -0,0 +1,129 @@
+/*
+ * Cyclic CAN transmit scheduler.
+ *
+ * Registered messages are kept on a list with their absolute due times.
+ * A single deferred timer call is always set for the earliest due time;
+ * when it runs, it sends everything that has fallen due and re-arms
+ * itself for the next.
+ *
+ * Messages registered with CAN_CYCLIC_STAGGER are offset from each other
+ * by CAN_CYCLIC_STAGGER_MS so that messages with the same period don't
+ * all compete for the transmit buffers in the same tick.
+ */
+
+#include <stddef.h>
+
+#include <config.h>
+
+#include <core/can.h>
+#include <core/can_cyclic.h>
+#include <core/timer.h>
+
+#define CAN_CYCLIC_LIST_END     (can_cyclic_t *)1
+
+static void                 can_cyclic_run(void);
+static timer_call_t         can_cyclic_call = {
+        { NULL, 0 },
+        can_cyclic_run,
+        0,
+        TIMER_CALL_THREAD
+};
+
+static can_cyclic_t         *can_cyclic_list = CAN_CYCLIC_LIST_END;
+static uint8_t              can_cyclic_count;
+
+void
+can_cyclic_register(can_cyclic_t *entry)
+{
+    uint16_t offset_ms = entry->offset_ms;
+
+    if (entry->_next != NULL) {
+        return;
+    }
+    REQUIRE(entry->period_ms > 0);
+
+    if (offset_ms == CAN_CYCLIC_STAGGER) {
+        offset_ms = (uint16_t)(((uint16_t)can_cyclic_count * CAN_CYCLIC_STAGGER_MS) % entry->period_ms);
+    }
+    entry->_due_ms = timer_now_ms() + offset_ms;
+    entry->_next = can_cyclic_list;
+    can_cyclic_list = entry;
+    can_cyclic_count++;
+
+    // run soon to work out when this is next due
+    timer_call_reset(can_cyclic_call, 1);
+}
+
+void
+can_cyclic_unregister(can_cyclic_t *entry)
+{
+    can_cyclic_t **ep;
+
+    for (ep = &can_cyclic_list; *ep != CAN_CYCLIC_LIST_END; ep = &(*ep)->_next) {
+        if (*ep == entry) {
+            *ep = entry->_next;
+            entry->_next = NULL;
+            can_cyclic_count--;
+            break;
+        }
+    }
+}
+
+/*
+ * Send a message that has fallen due, and work out when it is next due.
+ */
+static void
+can_cyclic_send(can_cyclic_t *entry, uint32_t now)
+{
+    uint32_t late_ms = now - entry->_due_ms;
+    uint8_t data[8];
+    uint8_t dlc;
+
+    // skip whole periods that have already gone by
+    if (late_ms >= entry->period_ms) {
+        const uint32_t skipped = late_ms / entry->period_ms;
+
+        entry->missed = ((entry->missed + skipped) > 0xffff) ? 0xffff : (uint16_t)(entry->missed + skipped);
+        entry->_due_ms += skipped * entry->period_ms;
+        late_ms -= skipped * entry->period_ms;
+    }
+    if (late_ms > entry->jitter_max_ms) {
+        entry->jitter_max_ms = (uint16_t)late_ms;
+    }
+    entry->_due_ms += entry->period_ms;
+
+    dlc = entry->build(entry, &data[0]);
+    if (dlc != CAN_CYCLIC_SKIP) {
+        if (!can_tx_async(entry->id, dlc, &data[0]) && (entry->missed < 0xffff)) {
+            entry->missed++;
+        }
+    }
+}
+
+static void
+can_cyclic_run(void)
+{
+    const uint32_t now = timer_now_ms();
+    can_cyclic_t *entry;
+    can_cyclic_t *next;
+    uint32_t next_ms = 0xffff;
+
+    // builders may unregister their own entry, so fetch the link first
+    for (entry = can_cyclic_list; entry != CAN_CYCLIC_LIST_END; entry = next) {
+        uint32_t until_ms;
+
+        next = entry->_next;
+
+        // due times are compared by difference so that they can wrap
+        if ((int32_t)(now - entry->_due_ms) >= 0) {
+            can_cyclic_send(entry, now);
+        }
+        until_ms = entry->_due_ms - now;
+        if (until_ms < next_ms) {
+            next_ms = until_ms;
+        }
+    }
+    if (can_cyclic_list != CAN_CYCLIC_LIST_END) {
+        timer_call_reset(can_cyclic_call, (next_ms > 0) ? (uint16_t)next_ms : 1);
+    }
+}
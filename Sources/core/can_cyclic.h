@@ -0,0 +1,55 @@
+/*
+ * Cyclic CAN transmit scheduler.
+ */
+
+#ifndef CORE_CAN_CYCLIC_H_
+#define CORE_CAN_CYCLIC_H_
+
+#include <core/can.h>
+#include <core/lib.h>
+
+/**
+ * Periodic CAN message.
+ *
+ * Each time the message falls due, build is called to fill in the
+ * payload and the frame is queued with can_tx_async. Due times are
+ * absolute, so the period does not drift with main loop load; lateness
+ * is recorded in jitter_max_ms, and slots that could not be sent at all
+ * are counted in missed.
+ */
+typedef struct _can_cyclic {
+    uint32_t            id;                 // may be changed while registered
+    uint16_t            period_ms;
+    uint16_t            offset_ms;          // delay before the first send, or CAN_CYCLIC_STAGGER
+    uint8_t             (*build)(struct _can_cyclic *entry, uint8_t *data); // returns DLC or CAN_CYCLIC_SKIP
+    void                *ctx;               // for the builder
+    uint16_t            jitter_max_ms;      // latest send relative to the due time
+    uint16_t            missed;             // slots skipped or dropped, saturating
+    uint32_t            _due_ms;
+    struct _can_cyclic  *_next;             // NULL when not registered
+} can_cyclic_t;
+
+/**
+ * offset_ms value asking the scheduler to pick an offset that keeps
+ * the message clear of the others.
+ */
+#define CAN_CYCLIC_STAGGER  0xffff
+
+/**
+ * Builder return value; don't send anything this period.
+ */
+#define CAN_CYCLIC_SKIP     0xff
+
+/**
+ * Start sending a periodic message.
+ *
+ * @note does nothing to an already-registered message.
+ */
+extern void can_cyclic_register(can_cyclic_t *entry);
+
+/**
+ * Stop sending a periodic message.
+ */
+extern void can_cyclic_unregister(can_cyclic_t *entry);
+
+#endif /* CORE_CAN_CYCLIC_H_ */
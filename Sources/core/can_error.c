@@ -0,0 +1,123 @@
+/*
+ * CAN bus-off detection and recovery.
+ *
+ * The controller reports bus-off through the status-change interrupt.
+ * Recovery runs on its own thread: the transceiver is put into standby
+ * for a back-off period, then returned to normal mode and the controller
+ * is reinitialised at the EEPROM bitrate. If the bus stays up for
+ * CAN_BUS_OFF_STABLE_MS the recovery is complete and its duration is
+ * recorded; otherwise the back-off is doubled, up to
+ * CAN_BUS_OFF_BACKOFF_MAX_MS, and the cycle repeats.
+ */
+
+#include <config.h>
+
+#include <core/can.h>
+#include <core/can_error.h>
+#include <core/io.h>
+#include <core/lib.h>
+#include <core/mrs_bootrom.h>
+#include <core/pt.h>
+#include <core/timer.h>
+
+static void                 can_error_thread(struct pt *pt);
+static pt_list_entry_t      can_error_entry = pt_list_entry(can_error_thread, PT_EVENT_TIMER);
+
+static can_error_stats_t    can_error_totals;
+static volatile bool        can_error_bus_off_flag;
+static bool                 can_error_active;
+
+void
+can_error_init(void)
+{
+    pt_list_register(&can_error_entry);
+}
+
+void
+can_error_bus_off(void)
+{
+    can_error_bus_off_flag = TRUE;
+    if (can_error_totals.bus_off_events < 0xffff) {
+        can_error_totals.bus_off_events++;
+    }
+    pt_list_wake(&can_error_entry);
+}
+
+bool
+can_error_recovering(void)
+{
+    return can_error_active;
+}
+
+const can_error_stats_t *
+can_error_stats(void)
+{
+    return &can_error_totals;
+}
+
+static void
+can_error_thread(struct pt *pt)
+{
+    static timer_t  can_error_timer;
+    static uint32_t start_ms;
+    static uint16_t backoff_ms;
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, can_error_bus_off_flag);
+        can_error_bus_off_flag = FALSE;
+
+        if (!can_error_active) {
+            can_error_active = TRUE;
+            start_ms = timer_now_ms();
+            backoff_ms = CAN_BUS_OFF_BACKOFF_MIN_MS;
+        }
+
+        // park the transceiver in standby and stay off the bus for a
+        // while; EN must go low with STB_N, as STB_N low with EN high is
+        // the go-to-sleep command, which would drop INH and our supply
+        CAN_EN_ClrVal();
+        CAN_STB_N_ClrVal();
+        pt_delay(pt, can_error_timer, backoff_ms);
+        if (backoff_ms < (CAN_BUS_OFF_BACKOFF_MAX_MS / 2)) {
+            backoff_ms *= 2;
+        } else {
+            backoff_ms = CAN_BUS_OFF_BACKOFF_MAX_MS;
+        }
+
+        // back to normal mode; once it has settled, ERR_N low means the
+        // transceiver has seen a bus or local failure
+        CAN_EN_SetVal();
+        CAN_STB_N_SetVal();
+        pt_delay(pt, can_error_timer, CAN_BUS_OFF_SETTLE_MS);
+        if (!DI_CAN_ERR_GetVal() && (can_error_totals.transceiver_faults < 0xffff)) {
+            can_error_totals.transceiver_faults++;
+        }
+
+        // restart the controller, and the transmit queue that went with it
+        can_reinit(mrs_can_bitrate());
+        can_error_bus_off_flag = FALSE;
+        EnterCritical();
+        can_tx_free();
+        ExitCritical();
+
+        // the bus has to stay up for a while before we call it recovered
+        timer_reset(can_error_timer, CAN_BUS_OFF_STABLE_MS);
+        pt_wait(pt, can_error_bus_off_flag || timer_expired(can_error_timer));
+
+        if (!can_error_bus_off_flag) {
+            const uint32_t elapsed = timer_now_ms() - start_ms;
+            const uint16_t recovery_ms = (elapsed > 0xffff) ? 0xffff : (uint16_t)elapsed;
+
+            can_error_active = FALSE;
+            can_error_totals.recoveries++;
+            can_error_totals.last_recovery_ms = recovery_ms;
+            if (recovery_ms > can_error_totals.max_recovery_ms) {
+                can_error_totals.max_recovery_ms = recovery_ms;
+            }
+            print("CAN bus-off recovered in %u ms", recovery_ms);
+        }
+    }
+    pt_end(pt);
+}
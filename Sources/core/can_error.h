@@ -0,0 +1,43 @@
+/*
+ * CAN bus-off detection and recovery.
+ */
+
+#ifndef CORE_CAN_ERROR_H_
+#define CORE_CAN_ERROR_H_
+
+#include <core/lib.h>
+
+/**
+ * Recovery statistics.
+ */
+typedef struct {
+    uint16_t    bus_off_events;
+    uint16_t    recoveries;
+    uint16_t    transceiver_faults;     // DI_CAN_ERR asserted when restarting
+    uint16_t    last_recovery_ms;       // bus-off to stable bus, saturating
+    uint16_t    max_recovery_ms;
+} can_error_stats_t;
+
+/**
+ * Start the recovery thread.
+ *
+ * Called by can_reinit.
+ */
+extern void can_error_init(void);
+
+/**
+ * Interrupt callback; the controller has gone bus-off.
+ */
+extern void can_error_bus_off(void);
+
+/**
+ * Test whether the controller is bus-off or recovering.
+ */
+extern bool can_error_recovering(void);
+
+/**
+ * Get the recovery statistics.
+ */
+extern const can_error_stats_t *can_error_stats(void);
+
+#endif /* CORE_CAN_ERROR_H_ */
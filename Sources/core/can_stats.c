@@ -0,0 +1,191 @@
+/*
+ * CAN bus statistics.
+ *
+ * The interrupt handlers only count frames and add up their nominal
+ * length in bits; everything else is done every CAN_STATS_PERIOD_MS on
+ * the main loop, which samples the MSCAN error counters and, if
+ * CAN_STATS_ID is set, broadcasts a status frame:
+ *
+ *  byte    contents
+ *  0       bus load over the period, percent
+ *  1       CANRXERR
+ *  2       CANTXERR
+ *  3       bus-off events since startup, saturating at 127; bit 7 set while recovering
+ *  4       RX frames dropped because a FIFO was full during the period, saturating
+ *  5       TX frames dropped because a queue was full during the period, saturating
+ *  6-7     RX frames during the period, big-endian
+ *
+ * Bus load counts the frames this node sends and receives, so frames
+ * rejected by the hardware acceptance filters are not included, nor is
+ * bit stuffing; it is a lower bound.
+ */
+
+#include <CAN1.h>
+
+#include <config.h>
+
+#include <core/can.h>
+#include <core/can_error.h>
+#include <core/can_stats.h>
+#include <core/mrs_bootrom.h>
+#include <core/timer.h>
+
+// nominal frame length without data, including the interframe space
+#define CAN_STATS_STD_BITS      47
+#define CAN_STATS_EXT_BITS      67
+
+#define CAN_STATS_FRAME_BITS(_buf)                                                          \
+        ((((_buf)->id & CAN_EXTENDED_FRAME_ID) ? CAN_STATS_EXT_BITS : CAN_STATS_STD_BITS)   \
+         + ((uint16_t)(_buf)->dlc << 3))
+
+static void                 can_stats_update(void);
+static timer_call_t         can_stats_call = {
+        { NULL, CAN_STATS_PERIOD_MS },
+        can_stats_update,
+        CAN_STATS_PERIOD_MS,
+        TIMER_CALL_THREAD
+};
+
+static can_stats_t          can_stats_totals;
+static uint32_t             can_stats_bits;
+static uint16_t             can_stats_rx_period;
+static uint16_t             can_stats_kbps;
+static uint16_t             can_stats_last_rx_overflows;
+static uint16_t             can_stats_last_tx_drops;
+
+void
+can_stats_init(uint8_t rate)
+{
+    switch (rate) {
+    case MRS_CAN_1000KBPS:
+        can_stats_kbps = 1000;
+        break;
+    case MRS_CAN_800KBPS:
+        can_stats_kbps = 800;
+        break;
+    case MRS_CAN_500KBPS:
+        can_stats_kbps = 500;
+        break;
+    case MRS_CAN_250KBPS:
+        can_stats_kbps = 250;
+        break;
+    case MRS_CAN_125KBPS:
+    default:
+        can_stats_kbps = 125;
+        break;
+    }
+    timer_call_register(can_stats_call);
+}
+
+void
+can_stats_rx_frame(const can_buf_t *buf)
+{
+    can_stats_totals.rx_frames++;
+    can_stats_rx_period++;
+    can_stats_bits += CAN_STATS_FRAME_BITS(buf);
+}
+
+void
+can_stats_tx_frame(const can_buf_t *buf)
+{
+    can_stats_totals.tx_frames++;
+    can_stats_bits += CAN_STATS_FRAME_BITS(buf);
+}
+
+const can_stats_t *
+can_stats(void)
+{
+    return &can_stats_totals;
+}
+
+/*
+ * Sum the receive FIFO overflow counters.
+ */
+static uint16_t
+can_stats_rx_overflows(void)
+{
+    uint16_t total = 0;
+    uint8_t lane;
+
+    for (lane = 0; lane < CAN_RX_LANES; lane++) {
+        total += can_rx_overflow_count(lane);
+    }
+    return total;
+}
+
+#ifdef CAN_STATS_ID
+/*
+ * Saturate a count to 8 bits.
+ */
+static uint8_t
+can_stats_u8(uint16_t count)
+{
+    return (count > 0xff) ? 0xff : (uint8_t)count;
+}
+#endif
+
+static void
+can_stats_update(void)
+{
+    uint32_t bits;
+    uint16_t rx_frames;
+    uint16_t rx_overflows;
+    uint16_t tx_drops;
+    uint8_t rx_err;
+    uint8_t tx_err;
+    uint8_t load;
+
+    // take the period's counts
+    EnterCritical();
+    bits = can_stats_bits;
+    can_stats_bits = 0;
+    rx_frames = can_stats_rx_period;
+    can_stats_rx_period = 0;
+    ExitCritical();
+
+    // the bitrate in kbit/s is also bits per millisecond
+    bits = (bits * 100) / ((uint32_t)can_stats_kbps * CAN_STATS_PERIOD_MS);
+    load = (bits > 100) ? 100 : (uint8_t)bits;
+    can_stats_totals.load_percent = load;
+    if (load > can_stats_totals.load_max_percent) {
+        can_stats_totals.load_max_percent = load;
+    }
+
+    // sample the error counters
+    rx_err = CANRXERR;
+    tx_err = CANTXERR;
+    if (rx_err > can_stats_totals.rx_err_max) {
+        can_stats_totals.rx_err_max = rx_err;
+    }
+    if (tx_err > can_stats_totals.tx_err_max) {
+        can_stats_totals.tx_err_max = tx_err;
+    }
+
+    // work out what was dropped during the period
+    rx_overflows = can_stats_rx_overflows();
+    tx_drops = can_tx_drop_count();
+
+#ifdef CAN_STATS_ID
+    {
+        uint8_t frame[8];
+
+        frame[0] = load;
+        frame[1] = rx_err;
+        frame[2] = tx_err;
+        frame[3] = (uint8_t)((can_error_stats()->bus_off_events > 0x7f) ? 0x7f : can_error_stats()->bus_off_events);
+        if (can_error_recovering()) {
+            frame[3] |= 0x80;
+        }
+        frame[4] = can_stats_u8(rx_overflows - can_stats_last_rx_overflows);
+        frame[5] = can_stats_u8(tx_drops - can_stats_last_tx_drops);
+        frame[6] = (uint8_t)(rx_frames >> 8);
+        frame[7] = (uint8_t)rx_frames;
+        (void)can_tx_async(CAN_EXTENDED_FRAME_ID | CAN_STATS_ID, sizeof(frame), &frame[0]);
+    }
+#else
+    (void)rx_frames;
+#endif
+
+    can_stats_last_rx_overflows = rx_overflows;
+    can_stats_last_tx_drops = tx_drops;
+}
@@ -0,0 +1,58 @@
+/*
+ * CAN bus statistics.
+ */
+
+#ifndef CORE_CAN_STATS_H_
+#define CORE_CAN_STATS_H_
+
+#include <core/can.h>
+#include <core/lib.h>
+
+/**
+ * Running totals since startup.
+ *
+ * Frame counts are updated at interrupt time; the rest are sampled
+ * every CAN_STATS_PERIOD_MS. Bus-off events are counted by can_error.
+ */
+typedef struct {
+    uint32_t    rx_frames;
+    uint32_t    tx_frames;
+    uint8_t     rx_err_max;             // highest CANRXERR seen
+    uint8_t     tx_err_max;             // highest CANTXERR seen
+    uint8_t     load_percent;           // bus load over the last period
+    uint8_t     load_max_percent;       // highest load over any period
+} can_stats_t;
+
+/**
+ * Start collecting statistics.
+ *
+ * Called by can_reinit.
+ *
+ * @param rate      The CAN bitrate; one of the MRS_CAN_* constants.
+ */
+extern void can_stats_init(uint8_t rate);
+
+/**
+ * Count a received frame.
+ *
+ * Called from the receive interrupt.
+ */
+extern void can_stats_rx_frame(const can_buf_t *buf);
+
+/**
+ * Count a transmitted frame.
+ *
+ * Called when a frame is loaded into a transmit buffer, with
+ * interrupts disabled.
+ */
+extern void can_stats_tx_frame(const can_buf_t *buf);
+
+/**
+ * Get the statistics.
+ *
+ * @return          Pointer to the statistics, which are updated
+ *                  at interrupt time.
+ */
+extern const can_stats_t *can_stats(void);
+
+#endif /* CORE_CAN_STATS_H_ */
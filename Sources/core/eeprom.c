@@ -0,0 +1,264 @@
+/*
+ * Write-behind EEPROM updates.
+ *
+ * Each IEE1_SetByte/SetWord/SetLong call blocks until it has been
+ * programmed, so a multi-byte write made from a handler holds up the
+ * main loop for all of it. Writes are instead queued a byte at a time
+ * and programmed by a thread that does at most one operation per pass,
+ * so the longest stall is a single operation. Bytes queued back to back
+ * that make up an aligned long (half an EEPROM sector) or word are
+ * programmed in one operation, and bytes that already hold the value are
+ * skipped. The data of a 6-byte MRS write, which was six byte operations
+ * in a row, is one long and one word on separate passes (see
+ * Tests/eeprom_test.c).
+ *
+ * Each eeprom_write call is given a sequence number; the bytes of a
+ * write are contiguous in the queue, so once its last byte has been
+ * programmed every earlier write has been too, and completion is just
+ * a comparison against the last sequence number retired.
+ */
+
+#include <IEE1.h>
+
+#include <config.h>
+
+#include <core/eeprom.h>
+#include <core/pt.h>
+
+#define EEPROM_QUEUE_MASK   (EEPROM_WRITE_QUEUE_SIZE - 1)
+
+typedef struct {
+    uint16_t        address;
+    uint8_t         value;
+    eeprom_write_t  seq;
+} eeprom_entry_t;
+
+static void             eeprom_thread(struct pt *pt);
+static pt_list_entry_t  eeprom_entry = pt_list_entry(eeprom_thread, 0);
+
+static eeprom_entry_t   eeprom_queue[EEPROM_WRITE_QUEUE_SIZE];
+static uint8_t          eeprom_head;
+static uint8_t          eeprom_count;
+static eeprom_write_t   eeprom_seq_queued;
+static eeprom_write_t   eeprom_seq_done;
+static uint16_t         eeprom_errors;
+static uint8_t          eeprom_failed[256 / 8];   // one bit per sequence number
+
+#define eeprom_mark_failed(_seq)    (eeprom_failed[(uint8_t)(_seq) >> 3] |= (uint8_t)(1 << ((_seq) & 7)))
+
+#define eeprom_slot(_n)     (&eeprom_queue[(eeprom_head + (_n)) & EEPROM_QUEUE_MASK])
+
+bool
+eeprom_write(uint16_t address, uint8_t len, const uint8_t *data, eeprom_write_t *handle)
+{
+    if ((len == 0) || (len > (EEPROM_WRITE_QUEUE_SIZE - eeprom_count))) {
+        return FALSE;
+    }
+
+    eeprom_seq_queued++;
+    eeprom_failed[eeprom_seq_queued >> 3] &= (uint8_t)~(1 << (eeprom_seq_queued & 7));
+    while (len--) {
+        eeprom_entry_t *e = eeprom_slot(eeprom_count);
+
+        e->address = address++;
+        e->value = *data++;
+        e->seq = eeprom_seq_queued;
+        eeprom_count++;
+    }
+    if (handle != NULL) {
+        *handle = eeprom_seq_queued;
+    }
+
+    pt_list_register(&eeprom_entry);
+    pt_list_wake(&eeprom_entry);
+    return TRUE;
+}
+
+bool
+eeprom_write_word(uint16_t address, uint16_t value, eeprom_write_t *handle)
+{
+    uint8_t data[2];
+
+    data[0] = (uint8_t)(value >> 8);
+    data[1] = (uint8_t)value;
+    return eeprom_write(address, sizeof(data), &data[0], handle);
+}
+
+uint8_t
+eeprom_write_space(void)
+{
+    return EEPROM_WRITE_QUEUE_SIZE - eeprom_count;
+}
+
+bool
+eeprom_write_done(eeprom_write_t handle)
+{
+    // sequence numbers wrap; no more than a queue's worth are outstanding
+    return (uint8_t)(eeprom_seq_done - handle) < 0x80;
+}
+
+bool
+eeprom_write_failed(eeprom_write_t handle)
+{
+    return (eeprom_failed[handle >> 3] & (1 << (handle & 7))) != 0;
+}
+
+bool
+eeprom_busy(void)
+{
+    return eeprom_count > 0;
+}
+
+uint8_t
+eeprom_read_byte(uint16_t address)
+{
+    uint8_t n = eeprom_count;
+    uint8_t value;
+
+    // newest queued value wins
+    while (n--) {
+        const eeprom_entry_t *e = eeprom_slot(n);
+
+        if (e->address == address) {
+            return e->value;
+        }
+    }
+    (void)IEE1_GetByte(address, &value);
+    return value;
+}
+
+uint16_t
+eeprom_error_count(void)
+{
+    return eeprom_errors;
+}
+
+/*
+ * Remove the entry at the head of the queue, noting the completion of
+ * its write if it was the last byte.
+ */
+static void
+eeprom_retire(void)
+{
+    const eeprom_write_t seq = eeprom_slot(0)->seq;
+
+    eeprom_head = (eeprom_head + 1) & EEPROM_QUEUE_MASK;
+    eeprom_count--;
+    if ((eeprom_count == 0) || (eeprom_slot(0)->seq != seq)) {
+        eeprom_seq_done = seq;
+        pt_list_signal(PT_EVENT_SIGNAL);
+    }
+}
+
+/*
+ * Count the queued bytes at the head that can be programmed in one
+ * operation: an aligned long or word whose bytes are queued back to
+ * back, otherwise a single byte.
+ */
+static uint8_t
+eeprom_run(void)
+{
+    const uint16_t address = eeprom_slot(0)->address;
+    uint8_t run;
+    uint8_t i;
+
+    for (run = 4; run > 1; run >>= 1) {
+        if (((address & (run - 1)) != 0) || (eeprom_count < run)) {
+            continue;
+        }
+        for (i = 1; i < run; i++) {
+            if (eeprom_slot(i)->address != (address + i)) {
+                break;
+            }
+        }
+        if (i == run) {
+            break;
+        }
+    }
+    return run;
+}
+
+/*
+ * Program the head of the queue, skipping anything that is unchanged.
+ *
+ * Returns after at most one program operation.
+ */
+static void
+eeprom_program(void)
+{
+    while (eeprom_count > 0) {
+        const uint16_t address = eeprom_slot(0)->address;
+        const uint8_t run = eeprom_run();
+        uint32_t value = 0;
+        bool programmed = FALSE;
+        byte result = ERR_OK;
+        uint8_t i;
+
+        for (i = 0; i < run; i++) {
+            value = (value << 8) | eeprom_slot(i)->value;
+        }
+
+        switch (run) {
+        case 4: {
+            dword current;
+
+            (void)IEE1_GetLong(address, &current);
+            if (current != value) {
+                result = IEE1_SetLong(address, value);
+                programmed = TRUE;
+            }
+            break;
+        }
+        case 2: {
+            word current;
+
+            (void)IEE1_GetWord(address, &current);
+            if (current != (word)value) {
+                result = IEE1_SetWord(address, (word)value);
+                programmed = TRUE;
+            }
+            break;
+        }
+        default: {
+            byte current;
+
+            (void)IEE1_GetByte(address, &current);
+            if (current != (byte)value) {
+                result = IEE1_SetByte(address, (byte)value);
+                programmed = TRUE;
+            }
+            break;
+        }
+        }
+
+        // charge a failure to every write that had bytes in the operation
+        if (result != ERR_OK) {
+            if (eeprom_errors < 0xffff) {
+                eeprom_errors++;
+            }
+            for (i = 0; i < run; i++) {
+                eeprom_mark_failed(eeprom_slot(i)->seq);
+            }
+        }
+        for (i = 0; i < run; i++) {
+            eeprom_retire();
+        }
+        if (programmed) {
+            return;
+        }
+    }
+}
+
+static void
+eeprom_thread(struct pt *pt)
+{
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, eeprom_count > 0);
+
+        eeprom_program();
+        pt_yield(pt);
+    }
+    pt_end(pt);
+}
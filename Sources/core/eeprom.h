@@ -0,0 +1,74 @@
+/*
+ * Write-behind EEPROM updates.
+ */
+
+#ifndef CORE_EEPROM_H_
+#define CORE_EEPROM_H_
+
+#include <core/lib.h>
+
+/**
+ * Write request handle.
+ */
+typedef uint8_t eeprom_write_t;
+
+/**
+ * Queue bytes to be written to EEPROM.
+ *
+ * The bytes are programmed in the background, a byte or an aligned
+ * word or long per program cycle; bytes that already hold the value
+ * are skipped. eeprom_read_byte sees queued values immediately.
+ *
+ * @param address   EEPROM address, as for IEE1_SetByte.
+ * @param len       Number of bytes to write.
+ * @param data      The bytes to write; copied before returning.
+ * @param handle    If not NULL, returns a handle for eeprom_write_done.
+ * @return          TRUE if the write was queued, FALSE if there is not
+ *                  room for all of it, in which case none of it is.
+ */
+extern bool eeprom_write(uint16_t address, uint8_t len, const uint8_t *data, eeprom_write_t *handle);
+
+/**
+ * Queue a big-endian word to be written to EEPROM, as IEE1_SetWord.
+ */
+extern bool eeprom_write_word(uint16_t address, uint16_t value, eeprom_write_t *handle);
+
+/**
+ * Get the number of bytes that can be queued.
+ *
+ * For a caller making several writes that must all be queued or none.
+ */
+extern uint8_t eeprom_write_space(void);
+
+/**
+ * Test whether a write has been committed to EEPROM.
+ *
+ * PT_EVENT_SIGNAL is signalled whenever a write completes, so a thread
+ * can wait on this with PT_EVENT_SIGNAL in its wake events.
+ */
+extern bool eeprom_write_done(eeprom_write_t handle);
+
+/**
+ * Test whether any part of a completed write failed to program.
+ *
+ * Only meaningful until 256 further writes have been queued.
+ */
+extern bool eeprom_write_failed(eeprom_write_t handle);
+
+/**
+ * Test whether any writes are still queued.
+ */
+extern bool eeprom_busy(void);
+
+/**
+ * Read a byte, including any value still waiting to be written.
+ */
+extern uint8_t eeprom_read_byte(uint16_t address);
+
+/**
+ * Get the number of program operations that the driver reported as
+ * failed, by any writer.
+ */
+extern uint16_t eeprom_error_count(void);
+
+#endif /* CORE_EEPROM_H_ */
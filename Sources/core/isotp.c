@@ -0,0 +1,397 @@
+/*
+ * ISO-TP (ISO 15765-2) transport.
+ *
+ * One connection between the IDs given to isotp_init, with static send
+ * and receive buffers of ISOTP_BUFFER_SIZE bytes.
+ *
+ * Incoming frames are handled by a CAN receive handler on the listener
+ * thread. Single frames are passed straight to app_isotp_receive; a first
+ * frame starts reassembly, answered with flow control asking for blocks
+ * of ISOTP_BLOCK_SIZE consecutive frames at least ISOTP_STMIN_MS apart.
+ * Flow control that can't be queued straight away is retried by the
+ * ISO-TP thread as transmit space frees up; if it still hasn't gone by
+ * the time the next consecutive frame is due, the message is abandoned.
+ *
+ * Outgoing messages are sent by the ISO-TP thread, which waits for the
+ * peer's flow control after the first frame and each block, and paces
+ * consecutive frames by the peer's STmin.
+ *
+ * All frames are padded to 8 bytes with ISOTP_PADDING.
+ */
+
+#include <string.h>
+
+#include <CAN1.h>
+
+#include <config.h>
+
+#include <core/callbacks.h>
+#include <core/can.h>
+#include <core/isotp.h>
+#include <core/pt.h>
+#include <core/timer.h>
+
+// protocol control information, high nibble of the first byte
+#define ISOTP_PCI_SINGLE        0x00
+#define ISOTP_PCI_FIRST         0x10
+#define ISOTP_PCI_CONSECUTIVE   0x20
+#define ISOTP_PCI_FLOW          0x30
+#define ISOTP_PCI_MASK          0xf0
+
+// flow status
+#define ISOTP_FC_CTS            0x0
+#define ISOTP_FC_WAIT           0x1
+#define ISOTP_FC_OVERFLOW       0x2
+#define ISOTP_FC_NONE           0xff    // nothing received yet
+
+#define ISOTP_MAX_LEN           4095
+
+static void                 isotp_thread(struct pt *pt);
+static pt_list_entry_t      isotp_entry = pt_list_entry(isotp_thread, PT_EVENT_TIMER | PT_EVENT_CAN_TX);
+
+static uint32_t             isotp_tx_id;
+static uint16_t             isotp_errors;
+
+// reception
+static uint8_t              isotp_rx_buf[ISOTP_BUFFER_SIZE];
+static uint16_t             isotp_rx_len;
+static uint16_t             isotp_rx_offset;        // 0 when not reassembling
+static uint8_t              isotp_rx_seq;
+static uint8_t              isotp_rx_block;         // consecutive frames left in this block
+static timer_t              isotp_rx_timer;
+static uint8_t              isotp_rx_fc_pending = ISOTP_FC_NONE;    // flow control waiting to be queued
+
+// transmission
+static uint8_t              isotp_tx_buf[ISOTP_BUFFER_SIZE];
+static uint16_t             isotp_tx_len;           // 0 when idle
+static uint16_t             isotp_tx_offset;
+static uint8_t              isotp_tx_seq;
+static volatile uint8_t     isotp_fc_status = ISOTP_FC_NONE;
+static uint8_t              isotp_fc_block_size;
+static uint8_t              isotp_fc_stmin;
+
+static void
+isotp_error(void)
+{
+    if (isotp_errors < 0xffff) {
+        isotp_errors++;
+    }
+}
+
+/*
+ * Queue a frame, padded to 8 bytes.
+ */
+static bool
+isotp_tx_frame(const uint8_t *pci, uint8_t pci_len, const uint8_t *data, uint8_t data_len)
+{
+    uint8_t frame[8];
+
+    // wait for space rather than have the queue count a drop
+    if (can_tx_ordered_space() == 0) {
+        return FALSE;
+    }
+    memset(frame, ISOTP_PADDING, sizeof(frame));
+    memcpy(&frame[0], pci, pci_len);
+    if (data_len > 0) {
+        memcpy(&frame[pci_len], data, data_len);
+    }
+    return can_tx_ordered(isotp_tx_id, sizeof(frame), &frame[0]);
+}
+
+/*
+ * Queue pending flow control for the message being received.
+ *
+ * If there is no room, leaves it pending for the ISO-TP thread to try
+ * again, unless the peer will have given up waiting for it; then the
+ * message is abandoned.
+ */
+static void
+isotp_rx_flow_send(void)
+{
+    uint8_t pci[3];
+
+    if (isotp_rx_fc_pending == ISOTP_FC_NONE) {
+        return;
+    }
+    pci[0] = ISOTP_PCI_FLOW | isotp_rx_fc_pending;
+    pci[1] = ISOTP_BLOCK_SIZE;
+    pci[2] = ISOTP_STMIN_MS;
+    if (isotp_tx_frame(&pci[0], sizeof(pci), NULL, 0)) {
+        isotp_rx_fc_pending = ISOTP_FC_NONE;
+    } else if (timer_expired(isotp_rx_timer)) {
+        isotp_rx_fc_pending = ISOTP_FC_NONE;
+        isotp_rx_offset = 0;
+        isotp_error();
+    }
+}
+
+/*
+ * Send flow control for the message being received.
+ */
+static void
+isotp_rx_flow(uint8_t status)
+{
+    isotp_rx_block = ISOTP_BLOCK_SIZE;
+    timer_reset(isotp_rx_timer, ISOTP_TIMEOUT_MS);
+
+    isotp_rx_fc_pending = status;
+    isotp_rx_flow_send();
+}
+
+static void
+isotp_rx_first(const can_buf_t *buf)
+{
+    const uint16_t len = ((uint16_t)(buf->data[0] & 0x0f) << 8) | buf->data[1];
+
+    if ((buf->dlc < 8) || (len < 8)) {
+        return;
+    }
+    if (isotp_rx_offset != 0) {
+        // a new message abandons the old one
+        isotp_error();
+    }
+    if (len > ISOTP_BUFFER_SIZE) {
+        isotp_rx_offset = 0;
+        isotp_rx_flow(ISOTP_FC_OVERFLOW);
+        isotp_error();
+        return;
+    }
+    memcpy(&isotp_rx_buf[0], &buf->data[2], 6);
+    isotp_rx_len = len;
+    isotp_rx_offset = 6;
+    isotp_rx_seq = 1;
+    isotp_rx_flow(ISOTP_FC_CTS);
+}
+
+static void
+isotp_rx_consecutive(const can_buf_t *buf)
+{
+    uint16_t count;
+
+    if (isotp_rx_offset == 0) {
+        return;
+    }
+    if (timer_expired(isotp_rx_timer) || ((buf->data[0] & 0x0f) != isotp_rx_seq)) {
+        isotp_rx_offset = 0;
+        isotp_error();
+        return;
+    }
+    count = isotp_rx_len - isotp_rx_offset;
+    if (count > 7) {
+        count = 7;
+    }
+    if (count > (uint16_t)(buf->dlc - 1)) {
+        count = buf->dlc - 1;
+    }
+    memcpy(&isotp_rx_buf[isotp_rx_offset], &buf->data[1], count);
+    isotp_rx_offset += count;
+    isotp_rx_seq = (isotp_rx_seq + 1) & 0x0f;
+
+    if (isotp_rx_offset >= isotp_rx_len) {
+        isotp_rx_offset = 0;
+        timer_reset(isotp_rx_timer, 0);
+        app_isotp_receive(&isotp_rx_buf[0], isotp_rx_len);
+    } else if ((ISOTP_BLOCK_SIZE > 0) && (--isotp_rx_block == 0)) {
+        isotp_rx_flow(ISOTP_FC_CTS);
+    } else {
+        timer_reset(isotp_rx_timer, ISOTP_TIMEOUT_MS);
+    }
+}
+
+static void
+isotp_can_handler(can_buf_t *buf, void *ctx)
+{
+    uint8_t len;
+
+    (void)ctx;
+
+    if (buf->dlc < 1) {
+        return;
+    }
+    switch (buf->data[0] & ISOTP_PCI_MASK) {
+    case ISOTP_PCI_SINGLE:
+        len = buf->data[0] & 0x0f;
+        if ((len > 0) && (len < buf->dlc)) {
+            if (isotp_rx_offset != 0) {
+                isotp_rx_offset = 0;
+                isotp_error();
+            }
+            app_isotp_receive(&buf->data[1], len);
+        }
+        break;
+    case ISOTP_PCI_FIRST:
+        isotp_rx_first(buf);
+        break;
+    case ISOTP_PCI_CONSECUTIVE:
+        isotp_rx_consecutive(buf);
+        break;
+    case ISOTP_PCI_FLOW:
+        if ((buf->dlc >= 3) && (isotp_tx_len != 0)) {
+            isotp_fc_block_size = buf->data[1];
+            isotp_fc_stmin = buf->data[2];
+            isotp_fc_status = buf->data[0] & 0x0f;
+            pt_list_wake(&isotp_entry);
+        }
+        break;
+    }
+}
+
+void
+isotp_init(uint32_t rx_id, uint32_t tx_id)
+{
+    isotp_tx_id = tx_id;
+    can_rx_register(rx_id, (rx_id & CAN_EXTENDED_FRAME_ID) ? 0x1fffffffUL : 0x7ffUL, isotp_can_handler, NULL);
+    pt_list_register(&isotp_entry);
+}
+
+bool
+isotp_send(const uint8_t *data, uint16_t len)
+{
+    if ((isotp_tx_len != 0) || (len == 0) || (len > ISOTP_BUFFER_SIZE) || (len > ISOTP_MAX_LEN)) {
+        return FALSE;
+    }
+    memcpy(&isotp_tx_buf[0], data, len);
+    isotp_tx_len = len;
+    pt_list_wake(&isotp_entry);
+    return TRUE;
+}
+
+bool
+isotp_busy(void)
+{
+    return isotp_tx_len != 0;
+}
+
+uint16_t
+isotp_error_count(void)
+{
+    return isotp_errors;
+}
+
+/*
+ * Queue the single frame for a short message.
+ */
+static bool
+isotp_tx_single(void)
+{
+    const uint8_t pci = ISOTP_PCI_SINGLE | (uint8_t)isotp_tx_len;
+
+    return isotp_tx_frame(&pci, 1, &isotp_tx_buf[0], (uint8_t)isotp_tx_len);
+}
+
+/*
+ * Queue the first frame of a long message.
+ */
+static bool
+isotp_tx_first(void)
+{
+    uint8_t pci[2];
+
+    pci[0] = ISOTP_PCI_FIRST | (uint8_t)(isotp_tx_len >> 8);
+    pci[1] = (uint8_t)isotp_tx_len;
+    if (!isotp_tx_frame(&pci[0], sizeof(pci), &isotp_tx_buf[0], 6)) {
+        return FALSE;
+    }
+    isotp_tx_offset = 6;
+    isotp_tx_seq = 1;
+    return TRUE;
+}
+
+/*
+ * Queue the next consecutive frame.
+ */
+static bool
+isotp_tx_consecutive(void)
+{
+    const uint8_t pci = ISOTP_PCI_CONSECUTIVE | isotp_tx_seq;
+    uint16_t count = isotp_tx_len - isotp_tx_offset;
+
+    if (count > 7) {
+        count = 7;
+    }
+    if (!isotp_tx_frame(&pci, 1, &isotp_tx_buf[isotp_tx_offset], (uint8_t)count)) {
+        return FALSE;
+    }
+    isotp_tx_offset += count;
+    isotp_tx_seq = (isotp_tx_seq + 1) & 0x0f;
+    return TRUE;
+}
+
+/*
+ * Convert STmin to a delay in ticks; sub-millisecond values round up
+ * to the next tick, and reserved values are treated as the maximum.
+ */
+static uint8_t
+isotp_stmin_ms(uint8_t stmin)
+{
+    if (stmin <= 0x7f) {
+        return stmin;
+    }
+    if ((stmin >= 0xf1) && (stmin <= 0xf9)) {
+        return 1;
+    }
+    return 0x7f;
+}
+
+static void
+isotp_thread(struct pt *pt)
+{
+    static timer_t  isotp_tx_timer;
+    static uint8_t  block;
+    static uint8_t  stmin_ms;
+
+    // flow control for a message being received goes ahead of our own
+    // frames, whichever of them the thread is waiting to send; the
+    // thread is woken by freed transmit buffers and by isotp_rx_timer
+    isotp_rx_flow_send();
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, isotp_tx_len != 0);
+
+        // frames are queued as space allows; a freed transmit buffer
+        // wakes the thread to try again
+        if (isotp_tx_len <= 7) {
+            pt_wait(pt, isotp_tx_single());
+            isotp_tx_len = 0;
+            continue;
+        }
+
+        isotp_fc_status = ISOTP_FC_NONE;
+        pt_wait(pt, isotp_tx_first());
+
+        while (isotp_tx_offset < isotp_tx_len) {
+            // wait for flow control
+            timer_reset(isotp_tx_timer, ISOTP_TIMEOUT_MS);
+            pt_wait(pt, (isotp_fc_status != ISOTP_FC_NONE) || timer_expired(isotp_tx_timer));
+            if (isotp_fc_status == ISOTP_FC_WAIT) {
+                isotp_fc_status = ISOTP_FC_NONE;
+                continue;
+            }
+            if (isotp_fc_status != ISOTP_FC_CTS) {
+                // overflow, timeout or nonsense
+                isotp_error();
+                break;
+            }
+            isotp_fc_status = ISOTP_FC_NONE;
+            block = isotp_fc_block_size;
+            stmin_ms = isotp_stmin_ms(isotp_fc_stmin);
+
+            // send a block; a block size of zero means no more flow control
+            for (;;) {
+                pt_wait(pt, isotp_tx_consecutive());
+                if ((isotp_tx_offset >= isotp_tx_len)
+                        || ((block != 0) && (--block == 0))) {
+                    break;
+                }
+                if (stmin_ms > 0) {
+                    // one extra tick, as the first may be partly gone
+                    pt_delay(pt, isotp_tx_timer, stmin_ms + 1);
+                }
+            }
+        }
+        isotp_tx_len = 0;
+    }
+    pt_end(pt);
+}
@@ -0,0 +1,48 @@
+/*
+ * ISO-TP (ISO 15765-2) transport.
+ */
+
+#ifndef CORE_ISOTP_H_
+#define CORE_ISOTP_H_
+
+#include <core/lib.h>
+
+/**
+ * Start ISO-TP on a pair of IDs.
+ *
+ * Registers a CAN receive handler for rx_id and starts the ISO-TP
+ * thread. Reassembled messages are passed to app_isotp_receive.
+ * Call once, from app_init.
+ *
+ * @param rx_id     ID the peer sends on; include CAN_EXTENDED_FRAME_ID
+ *                  for a 29-bit ID.
+ * @param tx_id     ID to send on.
+ */
+extern void isotp_init(uint32_t rx_id, uint32_t tx_id);
+
+/**
+ * Send a message.
+ *
+ * The message is copied and sent in the background; single- or
+ * multi-frame as required, paced by the peer's flow control.
+ *
+ * @param data      The message.
+ * @param len       Length of the message; at most ISOTP_BUFFER_SIZE.
+ * @return          TRUE if the message was accepted, FALSE if a
+ *                  previous message is still being sent or the message
+ *                  is too long.
+ */
+extern bool isotp_send(const uint8_t *data, uint16_t len);
+
+/**
+ * Test whether a message is still being sent.
+ */
+extern bool isotp_busy(void);
+
+/**
+ * Count of messages abandoned, in either direction, because of a
+ * timeout, sequence error or receiver overflow.
+ */
+extern uint16_t isotp_error_count(void);
+
+#endif /* CORE_ISOTP_H_ */
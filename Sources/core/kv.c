@@ -0,0 +1,313 @@
+/*
+ * Journaled key/value store in the EEPROM user area.
+ *
+ * The area is split into two halves, only one of which is current.
+ * Each half starts with a header, where magic is the byte 0x4b:
+ *
+ *  magic generation crc crc
+ *
+ * followed by records, appended in order as values are set:
+ *
+ *  key len generation data ... crc crc
+ *
+ * CRCs are CRC-16/CCITT, big-endian, over the preceding bytes of the
+ * header or record. IEE1 byte and word writes reprogram the whole EEPROM
+ * sector, so the header and each record start on a sector boundary and
+ * are padded out to whole sectors; an append only programs sectors that
+ * hold nothing committed, and a reset during it can only damage the new
+ * record.
+ *
+ * The current half is the one with a valid header and the newer
+ * generation. Reading its records stops at the first one that is
+ * erased, out of range, from another generation, or fails its CRC,
+ * which covers a record torn by a reset; the next append simply
+ * overwrites it. Generations are only 8 bits, so compaction also clears
+ * the first byte of every sector past the records it copies; records
+ * start on sector boundaries, so nothing left beyond the end of the
+ * journal can be read as a current record once the generation wraps.
+ *
+ * kv_init indexes the latest record for each key, so lookups don't
+ * search. When an append won't fit, the current records are copied
+ * into the other half in the background; its header is queued last, so
+ * the copy only takes over once it is complete, cleared sectors and
+ * all. Setting a value always appends to the journal rather than
+ * rewriting cells in place, so wear is spread over the whole area.
+ *
+ * Writes go through the write-behind queue, and reads see queued bytes.
+ */
+
+#include <string.h>
+
+#include <IEE1.h>
+
+#include <config.h>
+
+#include <core/eeprom.h>
+#include <core/kv.h>
+#include <core/lib.h>
+#include <core/pt.h>
+
+#define KV_MAGIC            0x4b
+#define KV_SECTOR_SIZE      8           // EEPROM erase sector; a power of 2
+#define KV_SECTORS(_len)    (((_len) + KV_SECTOR_SIZE - 1) & ~(KV_SECTOR_SIZE - 1))
+#define KV_HALF_SIZE        ((KV_AREA_END - KV_AREA_START) / 2)
+#define KV_HEADER_LEN       4
+#define KV_HEADER_SIZE      KV_SECTORS(KV_HEADER_LEN)
+#define KV_RECORD_OVERHEAD  5
+#define KV_RECORD_MAX       (KV_VALUE_MAX + KV_RECORD_OVERHEAD)
+
+static void             kv_gc_thread(struct pt *pt);
+static pt_list_entry_t  kv_gc_entry = pt_list_entry(kv_gc_thread, PT_EVENT_SIGNAL);
+
+static uint8_t          kv_index[KV_KEYS];      // offset of the latest record for each key, 0 if none
+static uint8_t          kv_half;                // current half
+static uint8_t          kv_generation;
+static uint16_t         kv_append;              // offset of the next record, sector aligned
+static uint16_t         kv_live;                // bytes in latest records, including padding
+static bool             kv_gc_active;
+
+static uint16_t
+kv_address(uint8_t half, uint16_t offset)
+{
+    return IEE1_AREA_START + KV_AREA_START + (half ? KV_HALF_SIZE : 0) + offset;
+}
+
+static void
+kv_read(uint8_t half, uint16_t offset, uint8_t len, uint8_t *dst)
+{
+    while (len--) {
+        *dst++ = eeprom_read_byte(kv_address(half, offset++));
+    }
+}
+
+/*
+ * Build a record; returns its length, without padding.
+ */
+static uint8_t
+kv_record(uint8_t *rec, uint8_t key, uint8_t len, const uint8_t *data, uint8_t generation)
+{
+    uint16_t crc;
+
+    rec[0] = key;
+    rec[1] = len;
+    rec[2] = generation;
+    (void)memcpy(&rec[3], data, len);
+    crc = crc16(0xffff, rec, len + 3);
+    rec[len + 3] = (uint8_t)(crc >> 8);
+    rec[len + 4] = (uint8_t)crc;
+    return len + KV_RECORD_OVERHEAD;
+}
+
+static void
+kv_header(uint8_t *hdr, uint8_t generation)
+{
+    uint16_t crc;
+
+    hdr[0] = KV_MAGIC;
+    hdr[1] = generation;
+    crc = crc16(0xffff, hdr, 2);
+    hdr[2] = (uint8_t)(crc >> 8);
+    hdr[3] = (uint8_t)crc;
+}
+
+/*
+ * Test whether a half has a valid header, returning its generation.
+ */
+static bool
+kv_header_valid(uint8_t half, uint8_t *generation)
+{
+    uint8_t hdr[KV_HEADER_LEN];
+    uint8_t ref[KV_HEADER_LEN];
+
+    kv_read(half, 0, sizeof(hdr), &hdr[0]);
+    kv_header(&ref[0], hdr[1]);
+    *generation = hdr[1];
+    return memcmp(hdr, ref, sizeof(hdr)) == 0;
+}
+
+/*
+ * Index the records in the current half.
+ */
+static void
+kv_scan(void)
+{
+    uint8_t rec[KV_RECORD_MAX];
+    uint16_t offset = KV_HEADER_SIZE;
+
+    (void)memset(kv_index, 0, sizeof(kv_index));
+    kv_live = 0;
+
+    while ((offset + KV_RECORD_OVERHEAD) <= KV_HALF_SIZE) {
+        uint8_t ref[KV_RECORD_MAX];
+        uint8_t len;
+
+        kv_read(kv_half, offset, 3, &rec[0]);
+        len = rec[1];
+        if ((rec[0] >= KV_KEYS)
+                || (len == 0)
+                || (len > KV_VALUE_MAX)
+                || (rec[2] != kv_generation)
+                || ((offset + KV_RECORD_OVERHEAD + len) > KV_HALF_SIZE)) {
+            break;
+        }
+        kv_read(kv_half, offset + 3, len + 2, &rec[3]);
+        (void)kv_record(&ref[0], rec[0], len, &rec[3], kv_generation);
+        if (memcmp(rec, ref, len + KV_RECORD_OVERHEAD) != 0) {
+            break;
+        }
+
+        // replaces any earlier record for the key
+        if (kv_index[rec[0]] != 0) {
+            kv_live -= KV_SECTORS(eeprom_read_byte(kv_address(kv_half, kv_index[rec[0]] + 1)) + KV_RECORD_OVERHEAD);
+        }
+        kv_index[rec[0]] = (uint8_t)offset;
+        kv_live += KV_SECTORS(len + KV_RECORD_OVERHEAD);
+        offset += KV_SECTORS(len + KV_RECORD_OVERHEAD);
+    }
+    kv_append = offset;
+}
+
+void
+kv_init(void)
+{
+    uint8_t gen0;
+    uint8_t gen1;
+    const bool valid0 = kv_header_valid(0, &gen0);
+    const bool valid1 = kv_header_valid(1, &gen1);
+
+    if (valid0 && valid1) {
+        // generations wrap; the newer is ahead by less than half the range
+        kv_half = ((uint8_t)(gen1 - gen0) < 0x80) ? 1 : 0;
+    } else if (valid0 || valid1) {
+        kv_half = valid1 ? 1 : 0;
+    } else {
+        // never used; start afresh in the first half
+        uint8_t hdr[KV_HEADER_LEN];
+
+        kv_half = 0;
+        gen0 = 0;
+        kv_header(&hdr[0], gen0);
+        (void)eeprom_write(kv_address(0, 0), sizeof(hdr), &hdr[0], NULL);
+    }
+    kv_generation = kv_half ? gen1 : gen0;
+    kv_scan();
+}
+
+uint8_t
+kv_get(uint8_t key, uint8_t *data)
+{
+    uint8_t len;
+
+    if ((key >= KV_KEYS) || (kv_index[key] == 0)) {
+        return 0;
+    }
+    len = eeprom_read_byte(kv_address(kv_half, kv_index[key] + 1));
+    kv_read(kv_half, kv_index[key] + 3, len, data);
+    return len;
+}
+
+bool
+kv_set(uint8_t key, uint8_t len, const uint8_t *data)
+{
+    uint8_t rec[KV_RECORD_MAX];
+    uint8_t size;
+    uint8_t old_size = 0;
+
+    if ((key >= KV_KEYS) || (len == 0) || (len > KV_VALUE_MAX) || kv_gc_active) {
+        return FALSE;
+    }
+
+    // unchanged?
+    if (kv_index[key] != 0) {
+        uint8_t old[KV_VALUE_MAX];
+        const uint8_t old_len = kv_get(key, &old[0]);
+
+        if ((old_len == len) && (memcmp(old, data, len) == 0)) {
+            return TRUE;
+        }
+        old_size = KV_SECTORS(old_len + KV_RECORD_OVERHEAD);
+    }
+
+    size = kv_record(&rec[0], key, len, data, kv_generation);
+    if ((kv_append + KV_SECTORS(size)) > KV_HALF_SIZE) {
+        // compact if that would make room; the caller tries again
+        if ((kv_live - old_size + KV_SECTORS(size)) <= (KV_HALF_SIZE - KV_HEADER_SIZE)) {
+            kv_gc_active = TRUE;
+            pt_list_register(&kv_gc_entry);
+            pt_list_wake(&kv_gc_entry);
+        }
+        return FALSE;
+    }
+    if (!eeprom_write(kv_address(kv_half, kv_append), size, &rec[0], NULL)) {
+        return FALSE;
+    }
+
+    kv_index[key] = (uint8_t)kv_append;
+    kv_live += KV_SECTORS(size) - old_size;
+    kv_append += KV_SECTORS(size);
+    return TRUE;
+}
+
+bool
+kv_busy(void)
+{
+    return kv_gc_active;
+}
+
+/*
+ * Copy the latest records into the other half, waiting for space in the
+ * EEPROM queue as required, then switch to it.
+ */
+static void
+kv_gc_thread(struct pt *pt)
+{
+    static uint8_t  new_index[KV_KEYS];
+    static uint8_t  rec[KV_RECORD_MAX];
+    static uint8_t  key;
+    static uint8_t  size;
+    static uint16_t offset;
+    static uint16_t clear;
+
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, kv_gc_active);
+
+        offset = KV_HEADER_SIZE;
+        for (key = 0; key < KV_KEYS; key++) {
+            uint8_t value[KV_VALUE_MAX];
+            uint8_t len;
+
+            new_index[key] = 0;
+            len = kv_get(key, &value[0]);
+            if (len == 0) {
+                continue;
+            }
+            size = kv_record(&rec[0], key, len, &value[0], kv_generation + 1);
+
+            // the queue signals PT_EVENT_SIGNAL as it drains
+            pt_wait(pt, eeprom_write(kv_address(kv_half ^ 1, offset), size, &rec[0], NULL));
+            new_index[key] = (uint8_t)offset;
+            offset += KV_SECTORS(size);
+        }
+
+        // clear whatever is left of older journals past the copy
+        rec[0] = 0xff;
+        for (clear = offset; clear < KV_HALF_SIZE; clear += KV_SECTOR_SIZE) {
+            if (eeprom_read_byte(kv_address(kv_half ^ 1, clear)) != 0xff) {
+                pt_wait(pt, eeprom_write(kv_address(kv_half ^ 1, clear), 1, &rec[0], NULL));
+            }
+        }
+
+        kv_header(&rec[0], kv_generation + 1);
+        pt_wait(pt, eeprom_write(kv_address(kv_half ^ 1, 0), KV_HEADER_LEN, &rec[0], NULL));
+
+        (void)memcpy(kv_index, new_index, sizeof(kv_index));
+        kv_half ^= 1;
+        kv_generation++;
+        kv_live = offset - KV_HEADER_SIZE;
+        kv_append = offset;
+        kv_gc_active = FALSE;
+    }
+    pt_end(pt);
+}
@@ -0,0 +1,54 @@
+/*
+ * Journaled key/value store in the EEPROM user area.
+ */
+
+#ifndef CORE_KV_H_
+#define CORE_KV_H_
+
+#include <core/lib.h>
+
+/*
+ * Area used, as offsets from the start of the EEPROM.
+ */
+#define KV_AREA_START       0x200
+#define KV_AREA_END         0x400
+
+/**
+ * Find the current copy of the store and index it.
+ *
+ * Call once at startup, with CONFIG_KV_STORE set.
+ */
+extern void kv_init(void);
+
+/**
+ * Get a value.
+ *
+ * @param key       The key.
+ * @param data      Buffer for the value, at least KV_VALUE_MAX bytes.
+ * @return          The length of the value, 0 if it has never been set.
+ */
+extern uint8_t kv_get(uint8_t key, uint8_t *data);
+
+/**
+ * Set a value.
+ *
+ * The new value is appended to the journal; nothing is written if it
+ * is unchanged. Setting the same value at a different length replaces
+ * it.
+ *
+ * @param key       The key.
+ * @param len       Length of the value, 1 to KV_VALUE_MAX.
+ * @param data      The value.
+ * @return          TRUE if the value was stored, FALSE if the key or
+ *                  length is out of range, the store is full, or it is
+ *                  busy compacting or waiting for EEPROM queue space;
+ *                  try again later.
+ */
+extern bool kv_set(uint8_t key, uint8_t len, const uint8_t *data);
+
+/**
+ * Test whether the store is compacting.
+ */
+extern bool kv_busy(void);
+
+#endif /* CORE_KV_H_ */
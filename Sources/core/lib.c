@@ -43,14 +43,30 @@ hexdump(uint8_t *addr, unsigned int count)
             count--;
         }
         print("");
+        can_console_flush();
         WDog1_Clear();
     }
 }
 
+uint16_t
+crc16(uint16_t crc, const uint8_t *data, uint16_t len)
+{
+    while (len--) {
+        uint8_t i;
+
+        crc ^= (uint16_t)*data++ << 8;
+        for (i = 0; i < 8; i++) {
+            crc = (crc & 0x8000) ? ((crc << 1) ^ 0x1021) : (crc << 1);
+        }
+    }
+    return crc;
+}
+
 void
 __require_abort(const char *file, int line)
 {
     print("ABORT: %s:%d", file, line);
+    can_console_flush();
     for (;;);
 }
 
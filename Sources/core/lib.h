@@ -38,4 +38,15 @@ extern void printn(const char *format, ...);
  */
 extern void hexdump(uint8_t *addr, unsigned int count);
 
+/**
+ * CRC-16/CCITT (polynomial 0x1021).
+ *
+ * @param crc           0xffff to start, or the result of the previous
+ *                      call to continue.
+ * @param data          Data to add to the CRC.
+ * @param len           Length of the data.
+ * @return              The updated CRC.
+ */
+extern uint16_t crc16(uint16_t crc, const uint8_t *data, uint16_t len);
+
 #endif /* LIB_H_ */
@@ -4,10 +4,11 @@
  * Messages handled at 0x1ffffff1:
  * 
  * receive              send
- * 00 00                00 id id id id st 00 vv     All-call "report your ID".
+ * 00 00                00 id id id id st 00 vv     All-call "report your ID"; see below.
  * 20 00                2f ff id id id id 00 00     Enter program mode - sets EEPROM and resets.
  * 20 10 id id id id    21 10 id id id id 00 00     Select id id id id for subsequent operations.
  * 20 03 aa aa cc       dd ...                      EEPROM read cc (1-8) bytes from address aa aa.
+ * 20 13 aa aa ll ll    (see below)                 EEPROM bulk read ll ll bytes from address aa aa.
  * 20 11 f3 33 af       21 11 01 00 00              EEPROM write enable
  * 20 02                20 f0 02 00 00              EEPROM write disable
  * 
@@ -15,8 +16,30 @@
  * 
  * aa aa ...            20 e8 00 00 00              write eeprom data to aa aa
  *                      20 e8 0f 00 00				eeprom not unlocked
+ *
+ * Scan responses are sent at 0x1ffffff0 in one of MRS_SCAN_SLOTS slots
+ * of MRS_SCAN_SLOT_MS. The first scan after reset uses the serial number
+ * modulo MRS_SCAN_SLOTS, so that modules with consecutive serial numbers
+ * answer in consecutive slots; later scans hash the serial number with
+ * the number of scans seen, so that modules that shared a slot are
+ * unlikely to share one again and repeated scans find every module.
+ *
+ * The writable locations are the CAN bitrate, and the user area
+ * (0x200-0x400) unless it holds the key/value store (CONFIG_KV_STORE).
  *                      
  * There are lots of eeprom error messages, we just send the most generic one.
+ *
+ * EEPROM bulk read data is streamed at 0x1ffffff4, paced so as not to
+ * crowd out other traffic:
+ *
+ * ss dd dd dd dd dd dd dd                          ss counts up from 00; the last data frame may be short.
+ * ss cc cc                                         CRC-16/CCITT (init ffff) of the data.
+ *
+ * A bulk read is abandoned by a scan, the selection of another module,
+ * or write disable. One that is out of range, or arrives while one is
+ * already in progress, is answered at 0x1ffffff2 with:
+ *
+ *                      21 13 0f 00 00
  */
 
 #include <string.h>
@@ -24,62 +47,112 @@
 #include <CAN1.h>
 #include <IEE1.h>
 
+#include <config.h>
+
 #include <core/can.h>
+#include <core/eeprom.h>
+#include <core/kv.h>
 #include <core/mrs_bootrom.h>
 #include <core/lib.h>
+#include <core/pt.h>
+#include <core/timer.h>
 
 #define	MRS_PARAM_BASE    IEE1_AREA_START
 
 const mrs_parameters_t 	mrs_parameters @(MRS_PARAM_BASE + 2);
-const char				mrs_module_type @(MRS_PARAM_BASE + 43);
+const char				mrs_module_type @(MRS_PARAM_BASE + MRS_PARAM_ADDR_MODULE_TYPE);
 
 static bool     mrs_module_selected = FALSE;
 static bool     mrs_eeprom_write_enable = FALSE;
 
 static void     mrs_param_copy_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *dst);
 static bool     mrs_param_compare_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *ref);
-static void		mrs_param_store_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *src);
+static bool		mrs_param_store_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *src, eeprom_write_t *handle);
+
+/*
+ * RAM shadow of the parameters read by scan, select and the bitrate
+ * lookup, so that they don't cost a driver call per byte. The shadow is
+ * loaded on first use (at boot, via mrs_can_bitrate), and reloaded after
+ * a parameter write that overlaps it. It holds whatever the EEPROM holds;
+ * checking the contents (such as the bitrate check codes) is up to the
+ * readers.
+ */
+#define MRS_SHADOW_BOOT_LEN     (MRS_PARAM_ADDR_BL_ID_2 + 6 - MRS_PARAM_ADDR_BL_VERS)
 
 typedef struct {
-    uint8_t     id:4;
-    uint8_t     len:4;
-    uint8_t     cmd[5];
-    void        (* func)(can_buf_t *buf);
-} mrs_bootrom_handler_t;
+    uint8_t     offset;
+    uint8_t     len;
+    uint8_t     *data;
+} mrs_shadow_window_t;
+
+static uint8_t  mrs_shadow_serial[4];
+static uint8_t  mrs_shadow_module_type[1];
+static uint8_t  mrs_shadow_boot[MRS_SHADOW_BOOT_LEN];   // bootloader version through bootloader ID 2
+static bool     mrs_shadow_valid;
+
+static const mrs_shadow_window_t    mrs_shadow_windows[] = {
+        { MRS_PARAM_ADDR_SERIAL,        sizeof(mrs_shadow_serial),      mrs_shadow_serial },
+        { MRS_PARAM_ADDR_MODULE_TYPE,   sizeof(mrs_shadow_module_type), mrs_shadow_module_type },
+        { MRS_PARAM_ADDR_BL_VERS,       sizeof(mrs_shadow_boot),        mrs_shadow_boot }
+};
+#define MRS_SHADOW_WINDOWS      (sizeof(mrs_shadow_windows) / sizeof(mrs_shadow_window_t))
+
+typedef void    (* mrs_handler_t)(can_buf_t *buf);
 
 static void     mrs_scan(can_buf_t *buf);
 static void     mrs_select(can_buf_t *buf);
-
-static const mrs_bootrom_handler_t  unselected_handlers[] = {
-        { 0x1, 2, { 0x00, 0x00},                    mrs_scan },
-        { 0x1, 2, { 0x20, 0x10},                    mrs_select }
-};
-
 static void     mrs_enter_program(can_buf_t *buf);
 static void     mrs_read_eeprom(can_buf_t *buf);
+static void     mrs_read_eeprom_bulk(can_buf_t *buf);
 static void     mrs_write_eeprom_enable(can_buf_t *buf);
 static void     mrs_write_eeprom_disable(can_buf_t *buf);
 static void     mrs_write_eeprom(can_buf_t *buf);
 
-static const mrs_bootrom_handler_t  selected_handlers[] = {
-        { 0x1, 2, { 0x20, 0x00},                    mrs_enter_program },
-        { 0x1, 2, { 0x20, 0x03},                    mrs_read_eeprom },
-        { 0x1, 5, { 0x20, 0x11, 0xf3, 0x33, 0xaf},  mrs_write_eeprom_enable },
-        { 0x1, 2, { 0x20, 0x02},                    mrs_write_eeprom_disable },
-        { 0x5, 0, { 0 },                            mrs_write_eeprom }
+// command code from the first two bytes of a frame at MRS_COMMAND_ID
+#define MRS_CMD(_a, _b)         (((uint16_t)(_a) << 8) | (_b))
+
+// bulk read stream
+#define MRS_STREAM_RESERVE  2       // ordered TX queue slots left for other messages
+
+static void             mrs_stream_thread(struct pt *pt);
+static pt_list_entry_t  mrs_stream_entry = pt_list_entry(mrs_stream_thread, PT_EVENT_CAN_TX);
+static bool             mrs_stream_active;
+static uint16_t         mrs_stream_address;
+static uint16_t         mrs_stream_remaining;
+static uint8_t          mrs_stream_seq;
+static uint16_t         mrs_stream_crc;
+
+// scan response, sent in this module's slot
+static uint8_t          mrs_scan_count;     // scans seen, 0 only before the first
+static void             mrs_scan_reply(void);
+static timer_call_t     mrs_scan_call = {
+        { NULL, 0 },
+        mrs_scan_reply,
+        0,
+        TIMER_CALL_THREAD
 };
 
+// EEPROM write replies, sent once the data is committed
+static void             mrs_write_thread(struct pt *pt);
+static pt_list_entry_t  mrs_write_entry = pt_list_entry(mrs_write_thread, PT_EVENT_SIGNAL);
+#define MRS_WRITE_PENDING   4       // must be a power of 2
+
+static struct {
+    eeprom_write_t      first;                  // backup bitrate copy, or the write itself
+    eeprom_write_t      last;
+} mrs_write_pending[MRS_WRITE_PENDING];
+static uint8_t          mrs_write_head;
+static uint8_t          mrs_write_tail;
+
 static uint8_t
 _mrs_can_try_bitrate(uint8_t addr)
 {
-    uint8_t rate_code;
-    uint8_t check_code;
+    uint8_t code[2];    // check code, rate code
 
-    (void)IEE1_GetByte(MRS_PARAM_BASE + addr, &check_code);
-    (void)IEE1_GetByte(MRS_PARAM_BASE + addr + 1, &rate_code);
+    mrs_param_copy_bytes(addr, sizeof(code), &code[0]);
 
-    if ((rate_code ^ check_code) == 0xff) {
-        return rate_code;
+    if ((code[0] ^ code[1]) == 0xff) {
+        return code[1];
     }
     return 0;
 }
@@ -101,57 +174,141 @@ mrs_can_bitrate(void)
     return MRS_CAN_125KBPS;
 }
 
-static bool
-mrs_dispatch_handler(const mrs_bootrom_handler_t *handler, uint8_t table_len, can_buf_t *buf)
+/*
+ * Decode a frame to its handler; NULL if it is not a command, or not
+ * one accepted in the current state. Scan and select are always
+ * accepted, everything else only while selected.
+ */
+static mrs_handler_t
+mrs_decode(const can_buf_t *buf)
 {
-    while (table_len--) {
-        if ((handler->id == (buf->id & 0xf)) &&             /* command matches */
-                (handler->len <= buf->dlc) &&                   /* message is long enough */
-                !memcmp(handler->cmd, buf->data, handler->len)) { /* prefix matches */
+    switch ((uint8_t)(buf->id & 0xf)) {
+    case MRS_COMMAND_ID & 0xf:
+        if (buf->dlc < 2) {
+            return NULL;
+        }
+        switch (MRS_CMD(buf->data[0], buf->data[1])) {
+        case MRS_CMD(0x00, 0x00):
+            return mrs_scan;
+        case MRS_CMD(0x20, 0x10):
+            return mrs_select;
+        default:
+            break;
+        }
+        if (!mrs_module_selected) {
+            return NULL;
+        }
+        switch (MRS_CMD(buf->data[0], buf->data[1])) {
+        case MRS_CMD(0x20, 0x00):
+            return mrs_enter_program;
+        case MRS_CMD(0x20, 0x03):
+            return mrs_read_eeprom;
+        case MRS_CMD(0x20, 0x13):
+            return mrs_read_eeprom_bulk;
+        case MRS_CMD(0x20, 0x11):
+            if ((buf->dlc >= 5)
+                    && (buf->data[2] == 0xf3)
+                    && (buf->data[3] == 0x33)
+                    && (buf->data[4] == 0xaf)) {
+                return mrs_write_eeprom_enable;
+            }
+            break;
+        case MRS_CMD(0x20, 0x02):
+            return mrs_write_eeprom_disable;
+        default:
+            break;
+        }
+        break;
 
-            handler->func(buf);
-            return TRUE;
+    case MRS_EEPROM_WRITE_ID & 0xf:
+        if (mrs_module_selected) {
+            return mrs_write_eeprom;
         }
-        handler++;
+        break;
+
+    default:
+        break;
     }
-    return FALSE;
+    return NULL;
 }
 
 bool
 mrs_bootrom_rx(can_buf_t *buf)
 {
-    if (mrs_dispatch_handler(unselected_handlers, 
-                             sizeof(unselected_handlers) / sizeof(mrs_bootrom_handler_t),
-                             buf)) {
-        return TRUE;
-    }
-    if (mrs_module_selected
-            && mrs_dispatch_handler(selected_handlers, 
-                                    sizeof(selected_handlers) / sizeof(mrs_bootrom_handler_t),
-                                    buf)) {
+    const mrs_handler_t handler = mrs_decode(buf);
+
+    if (handler != NULL) {
+        handler(buf);
         return TRUE;
     }
     can_trace(TRACE_MRS_BADMSG);
     return FALSE;
 }
 
+static void
+mrs_scan_reply(void)
+{
+    uint8_t data[8] = {0};
+
+    /* send the scan response message */
+    mrs_param_copy_bytes(MRS_PARAM_ADDR_SERIAL, 4, &data[1]);
+    mrs_param_copy_bytes(MRS_PARAM_ADDR_BL_VERS + 1, 1, &data[7]); /* low byte only */
+    (void)can_tx_ordered(MRS_SCAN_RSP_ID | CAN_EXTENDED_FRAME_ID,
+                         sizeof(data),
+                         &data[0]);
+}
+
+/*
+ * Pick the slot to answer this scan in.
+ */
+static uint16_t
+mrs_scan_slot(void)
+{
+    uint8_t serial[4];
+    uint32_t x;
+
+    mrs_param_copy_bytes(MRS_PARAM_ADDR_SERIAL, 4, &serial[0]);
+
+    // first scan: consecutive serial numbers get a slot each
+    if (mrs_scan_count == 0) {
+        return (uint16_t)((((uint16_t)serial[2] << 8) | serial[3]) % MRS_SCAN_SLOTS);
+    }
+
+    // later scans: mix the serial number with the scan count (murmur3
+    // finalizer), so that the modules sharing a slot change every scan
+    x = (((uint32_t)serial[0] << 24) | ((uint32_t)serial[1] << 16) | ((uint32_t)serial[2] << 8) | serial[3])
+        ^ ((uint32_t)mrs_scan_count * 0x9e3779b9UL);
+    x ^= x >> 16;
+    x *= 0x85ebca6bUL;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35UL;
+    x ^= x >> 16;
+    return (uint16_t)(x % MRS_SCAN_SLOTS);
+}
+
 void
 mrs_scan(can_buf_t *buf)
 {
-    uint8_t data[8] = {0};
+    uint16_t delay_ms;
     (void)buf;
 
     can_trace(TRACE_MRS_SCAN);
 
-    /* send the scan response message */
-    mrs_param_copy_bytes(MRS_PARAM_ADDR_SERIAL, 4, &data[1]);
-    mrs_param_copy_bytes(MRS_PARAM_ADDR_BL_VERS + 1, 1, &data[7]); /* low byte only */
-    can_tx_ordered(MRS_SCAN_RSP_ID | CAN_EXTENDED_FRAME_ID,
-                   sizeof(data),
-                   &data[0]);
+    /* answer in our slot; a repeated scan restarts the wait */
+    delay_ms = mrs_scan_slot() * MRS_SCAN_SLOT_MS;
+    if (++mrs_scan_count == 0) {
+        mrs_scan_count = 1;
+    }
+    if (delay_ms > 0) {
+        timer_call_reset(mrs_scan_call, delay_ms);
+    } else {
+        timer_call_reset(mrs_scan_call, 0);
+        mrs_scan_reply();
+    }
 
     mrs_module_selected = FALSE;
     mrs_eeprom_write_enable = FALSE;
+    mrs_stream_active = FALSE;
 }
 
 void 
@@ -184,6 +341,7 @@ mrs_select(can_buf_t *buf)
 
         /* someone else got selected, we should be quiet now */
         mrs_module_selected = FALSE;
+        mrs_stream_active = FALSE;
         return;
     }
 
@@ -192,9 +350,9 @@ mrs_select(can_buf_t *buf)
     /* send the 'selected' response */
     mrs_param_copy_bytes(MRS_PARAM_ADDR_SERIAL, 4, &data[2]);
     /* note no bootloader version */
-    can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
-                   sizeof(data),
-                   &data[0]);
+    (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                         sizeof(data),
+                         &data[0]);
 
     mrs_module_selected = TRUE;
 }
@@ -203,15 +361,98 @@ void
 mrs_read_eeprom(can_buf_t *buf)
 {
     const uint16_t param_offset = ((uint16_t)buf->data[2] << 8) | buf->data[3];
-    const uint8_t param_len = buf->data[4];
+    uint8_t param_len = buf->data[4];
     uint8_t data[8];
 
     can_trace(TRACE_MRS_GET_PARAM);
 
+    if (param_len > sizeof(data)) {
+        param_len = sizeof(data);
+    }
+
     mrs_param_copy_bytes(param_offset, param_len, &data[0]);
-    can_tx_ordered(MRS_EEPROM_READ_ID | CAN_EXTENDED_FRAME_ID,
-                   param_len,
-                   &data[0]);
+    (void)can_tx_ordered(MRS_EEPROM_READ_ID | CAN_EXTENDED_FRAME_ID,
+                         param_len,
+                         &data[0]);
+}
+
+void
+mrs_read_eeprom_bulk(can_buf_t *buf)
+{
+    const uint16_t address = ((uint16_t)buf->data[2] << 8) | buf->data[3];
+    const uint16_t len = ((uint16_t)buf->data[4] << 8) | buf->data[5];
+    static const uint8_t reject[5] = {0x21, 0x13, 0x0f, 0x00, 0x00};
+
+    can_trace(TRACE_MRS_GET_PARAM);
+
+    if ((buf->dlc < 6)
+            || mrs_stream_active
+            || (len == 0)
+            || (address >= IEE1_AREA_SIZE)
+            || (len > (IEE1_AREA_SIZE - address))) {
+        (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                             sizeof(reject),
+                             &reject[0]);
+        return;
+    }
+
+    mrs_stream_address = address;
+    mrs_stream_remaining = len;
+    mrs_stream_seq = 0;
+    mrs_stream_crc = 0xffff;
+    mrs_stream_active = TRUE;
+    pt_list_register(&mrs_stream_entry);
+    pt_list_wake(&mrs_stream_entry);
+}
+
+/*
+ * Send the next frame of a bulk read; data while there is any left,
+ * then the CRC.
+ */
+static void
+mrs_stream_send(void)
+{
+    uint8_t data[8];
+    uint8_t len;
+
+    data[0] = mrs_stream_seq++;
+    if (mrs_stream_remaining > 0) {
+        len = (mrs_stream_remaining > 7) ? 7 : (uint8_t)mrs_stream_remaining;
+        mrs_param_copy_bytes(mrs_stream_address, len, &data[1]);
+        mrs_stream_crc = crc16(mrs_stream_crc, &data[1], len);
+        mrs_stream_address += len;
+        mrs_stream_remaining -= len;
+    } else {
+        data[1] = (uint8_t)(mrs_stream_crc >> 8);
+        data[2] = (uint8_t)mrs_stream_crc;
+        len = 2;
+        mrs_stream_active = FALSE;
+    }
+    (void)can_tx_ordered(MRS_EEPROM_READ_ID | CAN_EXTENDED_FRAME_ID,
+                         len + 1,
+                         &data[0]);
+}
+
+static void
+mrs_stream_thread(struct pt *pt)
+{
+    pt_begin(pt);
+
+    for (;;) {
+        pt_wait(pt, mrs_stream_active);
+
+        // one frame per pass, leaving room in the queue for other messages
+        // and sleeping until a frame is sent if there isn't any; a scan
+        // cancels the stream
+        while (mrs_stream_active) {
+            pt_wait(pt, !mrs_stream_active || (can_tx_ordered_space() > MRS_STREAM_RESERVE));
+            if (mrs_stream_active) {
+                mrs_stream_send();
+                pt_yield(pt);
+            }
+        }
+    }
+    pt_end(pt);
 }
 
 void
@@ -223,9 +464,9 @@ mrs_write_eeprom_enable(can_buf_t *buf)
     can_trace(TRACE_MRS_EEPROM_ENABLE);
 
     mrs_eeprom_write_enable = TRUE;
-    can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
-                   sizeof(data),
-                   &data[0]);
+    (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                         sizeof(data),
+                         &data[0]);
 }
 
 void
@@ -237,9 +478,10 @@ mrs_write_eeprom_disable(can_buf_t *buf)
     can_trace(TRACE_MRS_EEPROM_DISABLE);
 
     mrs_eeprom_write_enable = FALSE;
-    can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
-                   sizeof(data),
-                   &data[0]);
+    mrs_stream_active = FALSE;
+    (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                         sizeof(data),
+                         &data[0]);
 }
 
 void
@@ -261,56 +503,172 @@ mrs_write_eeprom(can_buf_t *buf)
                 (src[1] >= MRS_CAN_1000KBPS) &&			// value is within bounds
                 (src[1] <= MRS_CAN_125KBPS)) {
 
-            // write backup copy, and approve this write
-            mrs_param_store_bytes(MRS_PARAM_CAN_RATE_2, 2, src);
-            data[2] = 0;
+            // write backup copy, and approve this write; only if there
+            // is room to queue both, so that they can't end up different
+            if (((uint8_t)(mrs_write_head - mrs_write_tail) < MRS_WRITE_PENDING)
+                    && (eeprom_write_space() >= (2 * len))
+                    && mrs_param_store_bytes(MRS_PARAM_CAN_RATE_2,
+                                             2,
+                                             src,
+                                             &mrs_write_pending[mrs_write_head & (MRS_WRITE_PENDING - 1)].first)) {
+                data[2] = 0;
+            }
         }
 
+#ifndef CONFIG_KV_STORE
         // write to "user" area of the EEPROM (first page only)
-        else if ((address >= 0x200) &&
-                (address < 0x400) &&
-                ((address + len) <= 0x400)) {
+        else if ((address >= KV_AREA_START) &&
+                (address < KV_AREA_END) &&
+                ((address + len) <= KV_AREA_END)) {
             data[2] = 0;
         }
+#endif
     }
 
-    // if write was approved
-    if (data[2] == 0) {
-        mrs_param_store_bytes(address, len, src);
+    // if write was approved, reply once it has been committed; an empty
+    // write has nothing to wait for
+    if ((data[2] == 0) && (len > 0)) {
+        const uint8_t slot = mrs_write_head & (MRS_WRITE_PENDING - 1);
+
+        if (((uint8_t)(mrs_write_head - mrs_write_tail) < MRS_WRITE_PENDING)
+                && mrs_param_store_bytes(address, len, src, &mrs_write_pending[slot].last)) {
+            if (address != MRS_PARAM_CAN_RATE_1) {
+                mrs_write_pending[slot].first = mrs_write_pending[slot].last;
+            }
+            mrs_write_head++;
+            pt_list_register(&mrs_write_entry);
+            pt_list_wake(&mrs_write_entry);
+            return;
+        }
+        data[2] = 0x0f;
     }
 
-    // and send response
-    can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
-                   sizeof(data),
-                   &data[0]);
+    // otherwise send response now
+    (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                         sizeof(data),
+                         &data[0]);
+}
+
+static void
+mrs_write_thread(struct pt *pt)
+{
+    uint8_t data[5] = {0x20, 0xe8, 0x00};
+
+    pt_begin(pt);
+
+    for (;;) {
+        // writes complete in the order they were made, as do the replies
+        while (mrs_write_tail != mrs_write_head) {
+            const uint8_t slot = mrs_write_tail & (MRS_WRITE_PENDING - 1);
+
+            if (!eeprom_write_done(mrs_write_pending[slot].last)) {
+                break;
+            }
+            data[2] = (eeprom_write_failed(mrs_write_pending[slot].first)
+                       || eeprom_write_failed(mrs_write_pending[slot].last)) ? 0x0f : 0x00;
+            (void)can_tx_ordered(MRS_RESPONSE_ID | CAN_EXTENDED_FRAME_ID,
+                                 sizeof(data),
+                                 &data[0]);
+            mrs_write_tail++;
+        }
+        pt_wait(pt, (mrs_write_tail != mrs_write_head)
+                    && eeprom_write_done(mrs_write_pending[mrs_write_tail & (MRS_WRITE_PENDING - 1)].last));
+    }
+    pt_end(pt);
+}
+
+/*
+ * Load the shadow from EEPROM, including queued writes.
+ */
+static void
+mrs_shadow_load(void)
+{
+    uint8_t i;
+
+    for (i = 0; i < MRS_SHADOW_WINDOWS; i++) {
+        const mrs_shadow_window_t *w = &mrs_shadow_windows[i];
+        uint8_t j;
+
+        for (j = 0; j < w->len; j++) {
+            w->data[j] = eeprom_read_byte(MRS_PARAM_BASE + w->offset + j);
+        }
+    }
+    mrs_shadow_valid = TRUE;
+}
+
+/*
+ * Find the shadow copy of a parameter range.
+ *
+ * Returns NULL if the range is not entirely within one shadow window.
+ */
+static const uint8_t *
+mrs_shadow_find(uint16_t param_offset, uint8_t param_len)
+{
+    uint8_t i;
+
+    if (!mrs_shadow_valid) {
+        mrs_shadow_load();
+    }
+    for (i = 0; i < MRS_SHADOW_WINDOWS; i++) {
+        const mrs_shadow_window_t *w = &mrs_shadow_windows[i];
+
+        if ((param_offset >= w->offset)
+                && ((param_offset + param_len) <= (w->offset + w->len))) {
+            return &w->data[param_offset - w->offset];
+        }
+    }
+    return NULL;
 }
 
 static void
 mrs_param_copy_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *dst)
 {
+    const uint8_t *shadow = mrs_shadow_find(param_offset, param_len);
+
+    if (shadow != NULL) {
+        (void)memcpy(dst, shadow, param_len);
+        return;
+    }
     while (param_len--) {
-        (void)IEE1_GetByte(MRS_PARAM_BASE + param_offset++, dst++);
+        *dst++ = eeprom_read_byte(MRS_PARAM_BASE + param_offset++);
     }
 }
 
 static bool
 mrs_param_compare_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *ref)
 {
-    while (param_len--) {
-        uint8_t v;
+    const uint8_t *shadow = mrs_shadow_find(param_offset, param_len);
 
-        (void)IEE1_GetByte(MRS_PARAM_BASE + param_offset++, &v);
-        if (v != *ref++) {
+    if (shadow != NULL) {
+        return memcmp(shadow, ref, param_len) == 0;
+    }
+    while (param_len--) {
+        if (eeprom_read_byte(MRS_PARAM_BASE + param_offset++) != *ref++) {
             return FALSE;
         }
     }
     return TRUE;
 }
 
-static void
-mrs_param_store_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *src)
+/*
+ * Queue a parameter write; reads see the new value straight away.
+ */
+static bool
+mrs_param_store_bytes(uint16_t param_offset, uint8_t param_len, uint8_t *src, eeprom_write_t *handle)
 {
-    while (param_len--) {
-        (void)IEE1_SetByte(MRS_PARAM_BASE + param_offset++, *src++);
+    uint8_t i;
+
+    // if the write touches the shadow, reload it on next use, which
+    // picks up the queued bytes
+    for (i = 0; i < MRS_SHADOW_WINDOWS; i++) {
+        const mrs_shadow_window_t *w = &mrs_shadow_windows[i];
+
+        if ((param_offset < (w->offset + w->len))
+                && ((param_offset + param_len) > w->offset)) {
+            mrs_shadow_valid = FALSE;
+            break;
+        }
     }
+
+    return eeprom_write(MRS_PARAM_BASE + param_offset, param_len, src, handle);
 }
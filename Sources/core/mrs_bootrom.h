@@ -17,9 +17,12 @@
 #define MRS_EEPROM_WRITE_ID         0x1ffffff5
 
 #define MRS_PARAM_ADDR_SERIAL       0x04
+#define MRS_PARAM_ADDR_MODULE_TYPE  0x2b
 #define MRS_PARAM_ADDR_BL_VERS      0x53
 #define MRS_PARAM_CAN_RATE_1        0x5b
 #define MRS_PARAM_CAN_RATE_2        0x5d
+#define MRS_PARAM_ADDR_BL_ID_1      0x5f
+#define MRS_PARAM_ADDR_BL_ID_2      0x65
 
 #define MRS_CAN_1000KBPS            1
 #define MRS_CAN_800KBPS             2
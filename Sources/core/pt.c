@@ -2,28 +2,195 @@
  * pt.c
  */
 
+#include <Cpu.h>
+
+#include <config.h>
+
 #include <core/lib.h>
 #include <core/pt.h>
+#include <core/timer.h>
 
 #define PT_LIST_END     (pt_list_entry_t *)4
 static pt_list_entry_t  *list = PT_LIST_END;
+static uint8_t          pt_list_wake_mask;
+static volatile uint8_t pt_list_events;
+static volatile bool    pt_list_idle_flag;
+static volatile uint32_t pt_list_idle_ms;
+static uint32_t         pt_list_busy_ms;
 
 void
 pt_list_register(pt_list_entry_t *entry)
 {
     if (entry->next == NULL) {
+        entry->ready = TRUE;
+        pt_list_wake_mask |= entry->wake_events;
         entry->next = list;
         list = entry;
     }
 }
 
+void
+pt_list_signal(uint8_t events)
+{
+    EnterCritical();
+    pt_list_events |= events;
+    ExitCritical();
+}
+
 void
 pt_list_run(void)
 {
     pt_list_entry_t     *entry = list;
-    
+    uint8_t             events;
+
+    // collect events signalled since the last pass
+    EnterCritical();
+    events = pt_list_events;
+    pt_list_events = 0;
+    ExitCritical();
+
     while (entry != PT_LIST_END) {
-        entry->func(&entry->pt);
+        if (entry->ready || (entry->wake_events & events)) {
+            // clear before running so that a wakeup while the thread
+            // is running is not lost
+            entry->ready = FALSE;
+            pt_profile(&entry->profile, entry->func(&entry->pt));
+            if (pt_status(&entry->pt) == PT_STATUS_YIELDED) {
+                entry->ready = TRUE;
+            }
+        }
         entry = entry->next;
     }
 }
+
+/*
+ * Test whether any thread is ready to run.
+ */
+static bool
+pt_list_runnable(void)
+{
+    pt_list_entry_t     *entry;
+
+    if (pt_list_events & pt_list_wake_mask) {
+        return TRUE;
+    }
+    for (entry = list; entry != PT_LIST_END; entry = entry->next) {
+        if (entry->ready) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+void
+pt_list_idle(void)
+{
+    // Interrupts stay disabled from the test until WAIT re-enables them,
+    // so a wakeup can't slip in between.
+    DisableInterrupts;
+    if (pt_list_runnable() || timer_call_pending()) {
+        EnableInterrupts;
+        return;
+    }
+    pt_list_idle_flag = TRUE;
+#ifdef CONFIG_IDLE_WAIT
+    __asm WAIT;
+#else
+    EnableInterrupts;
+    {
+        // spin until the next tick or until something becomes runnable
+        const uint8_t tick = (uint8_t)pt_list_idle_ms;
+
+        while (((uint8_t)pt_list_idle_ms == tick)
+                && !pt_list_runnable()
+                && !timer_call_pending()) {
+        }
+    }
+#endif
+    pt_list_idle_flag = FALSE;
+}
+
+void
+pt_list_tick(void)
+{
+    if (pt_list_idle_flag) {
+        pt_list_idle_ms++;
+    } else {
+        pt_list_busy_ms++;
+    }
+}
+
+void
+pt_list_load(uint32_t *idle_ms, uint32_t *busy_ms)
+{
+    EnterCritical();
+    *idle_ms = pt_list_idle_ms;
+    *busy_ms = pt_list_busy_ms;
+    ExitCritical();
+}
+
+#ifdef CONFIG_PT_PROFILE
+
+pt_profile_t        pt_profile_app_loop;
+pt_profile_t        pt_profile_timer_calls;
+pt_profile_t        pt_profile_can_rx;
+
+static void         pt_profile_report(void);
+static timer_call_t pt_profile_report_call = {
+        { NULL, PT_PROFILE_REPORT_MS },
+        pt_profile_report,
+        PT_PROFILE_REPORT_MS,
+        TIMER_CALL_THREAD
+};
+
+void
+pt_profile_init(void)
+{
+    timer_call_register(pt_profile_report_call);
+}
+
+void
+pt_profile_update(pt_profile_t *profile, uint16_t counts)
+{
+    if (profile->calls < 0xffff) {
+        profile->calls++;
+    }
+    profile->total_counts += counts;
+    if (counts > profile->max_counts) {
+        profile->max_counts = counts;
+    }
+}
+
+static void
+pt_profile_print(const char *name, const void *func, pt_profile_t *profile)
+{
+    print("%s %p: n=%u tot=%ld max=%u",
+          name,
+          func,
+          profile->calls,
+          profile->total_counts,
+          profile->max_counts);
+    profile->calls = 0;
+    profile->max_counts = 0;
+    profile->total_counts = 0;
+}
+
+static void
+pt_profile_report(void)
+{
+    pt_list_entry_t     *entry;
+    uint32_t            idle_ms;
+    uint32_t            busy_ms;
+
+    for (entry = list; entry != PT_LIST_END; entry = entry->next) {
+        pt_profile_print("pt", (const void *)entry->func, &entry->profile);
+    }
+    pt_profile_print("app", NULL, &pt_profile_app_loop);
+    pt_profile_print("tcall", NULL, &pt_profile_timer_calls);
+    pt_profile_print("canrx", NULL, &pt_profile_can_rx);
+
+    pt_list_load(&idle_ms, &busy_ms);
+    print("idle=%ld busy=%ld", idle_ms, busy_ms);
+}
+
+#endif // CONFIG_PT_PROFILE
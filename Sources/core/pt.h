@@ -8,6 +8,10 @@
 
 #include <stddef.h>
 
+#include <PE_Types.h>
+
+#include <config.h>
+
 /* Protothread status values */
 #define PT_STATUS_BLOCKED   0
 #define PT_STATUS_FINISHED  1
@@ -105,16 +109,17 @@ struct pt {
  * Yield the current timeslice.
  * 
  * Execution will resume at this point the next time the protothread is run.
+ * A yielded thread on the thread list stays runnable.
  *
  * @param pt            The current protothread.
  */
 #define pt_yield(pt)                                    \
         do {                                            \
-            pt_label(pt, PT_STATUS_YIELDED);            \
-            if (pt_status(pt) == PT_STATUS_YIELDED) {   \
-                (pt)->status = PT_STATUS_BLOCKED;       \
-                return;                                 \
-            }                                           \
+            (pt)->label = __LINE__;                     \
+            (pt)->status = PT_STATUS_YIELDED;           \
+            return;                                     \
+        case __LINE__:                                  \
+            (pt)->status = PT_STATUS_BLOCKED;           \
         } while (0)
 
 #define pt_exit(pt, stat)       \
@@ -123,19 +128,122 @@ struct pt {
             return;             \
         } while (0)
 
+/**
+ * Thread profiling.
+ * 
+ * With CONFIG_PT_PROFILE set, each thread list entry and the other main loop
+ * callouts accumulate the number of times they have run and the time spent
+ * in them, in timer_counter() counts; so does the CAN receive interrupt.
+ * The statistics are printed to the console every PT_PROFILE_REPORT_MS and
+ * then reset. Without CONFIG_PT_PROFILE this all compiles away.
+ */
+#ifdef CONFIG_PT_PROFILE
+#include <core/timer.h>
+
+typedef struct {
+    uint16_t        calls;
+    uint16_t        max_counts;             // longest single run
+    uint32_t        total_counts;
+} pt_profile_t;
+
+# define PT_PROFILE_INIT            , { 0, 0, 0 }
+# define pt_profile(_profile, _stmt)                                            \
+        do {                                                                    \
+            const uint16_t _pt_profile_start = timer_counter();                 \
+            _stmt;                                                              \
+            pt_profile_update(_profile, timer_counter_elapsed(_pt_profile_start)); \
+        } while(0)
+
+extern pt_profile_t pt_profile_app_loop;
+extern pt_profile_t pt_profile_timer_calls;
+extern pt_profile_t pt_profile_can_rx;
+extern void         pt_profile_init(void);
+extern void         pt_profile_update(pt_profile_t *profile, uint16_t counts);
+#else
+# define PT_PROFILE_INIT
+# define pt_profile(_profile, _stmt)    do { _stmt; } while(0)
+# define pt_profile_init()              do {} while(0)
+#endif
+
 /**
  * Thread list.
  * 
  * This provides a mechanism where optional threads can be registered
- * where they will be run each time around the main loop.
+ * to be run from the main loop.
+ * 
+ * A registered thread is only run when it is ready; that is, when it has
+ * just been registered, when it yielded last time it ran, when it has
+ * been woken with pt_list_wake(), or when one of the events in its
+ * wake_events mask has been signalled. A thread that is blocked in
+ * pt_wait() costs nothing until then, so anything that can change the
+ * condition it is waiting on must be covered by one of those.
  */
 typedef struct _pt_list_entry {
-    const void              (*func)(struct pt *pt);
+    void                    (*func)(struct pt *pt);
     struct _pt_list_entry   *next;
     struct pt               pt;
+    uint8_t                 wake_events;    // PT_EVENT_* that make the thread ready
+    volatile uint8_t        ready;
+#ifdef CONFIG_PT_PROFILE
+    pt_profile_t            profile;
+#endif
 } pt_list_entry_t;
 
+#define pt_list_entry(_func, _wake_events)                                      \
+        { _func, NULL, pt_init(), _wake_events, 1 PT_PROFILE_INIT }
+
+/**
+ * Wake events.
+ */
+#define PT_EVENT_TIMER      0x01            // a timer expired
+#define PT_EVENT_CAN_RX     0x02            // a CAN message was queued
+#define PT_EVENT_ADC        0x04            // an ADC cycle completed
+#define PT_EVENT_SIGNAL     0x08            // pt_list_signal(PT_EVENT_SIGNAL) was called
+#define PT_EVENT_CAN_TX     0x10            // a CAN transmit buffer was freed
+
 extern void     pt_list_register(pt_list_entry_t *entry);
 extern void     pt_list_run(void);
 
+/**
+ * Make every thread waiting on any of the given events ready.
+ * 
+ * Interrupt-safe.
+ * 
+ * @param events        Mask of PT_EVENT_* values.
+ */
+extern void     pt_list_signal(uint8_t events);
+
+/**
+ * Idle the CPU if there is nothing to run.
+ * 
+ * Call at the end of the main loop. If no thread is ready, no wake event
+ * is pending and no deferred timer callback is waiting, the CPU is put
+ * into WAIT mode (if CONFIG_IDLE_WAIT is set) until the next interrupt.
+ * The timer tick guarantees a wakeup at least every millisecond.
+ */
+extern void     pt_list_idle(void);
+
+/**
+ * Idle accounting; call from the timer tick interrupt.
+ */
+extern void     pt_list_tick(void);
+
+/**
+ * Get the number of timer ticks spent idle and busy.
+ * 
+ * Each tick is accounted to whichever state the main loop was in when
+ * it occurred.
+ * 
+ * @param idle_ms       Returns the number of idle ticks.
+ * @param busy_ms       Returns the number of busy ticks.
+ */
+extern void     pt_list_load(uint32_t *idle_ms, uint32_t *busy_ms);
+
+/**
+ * Make a single thread ready.
+ * 
+ * Interrupt-safe.
+ */
+#define pt_list_wake(_entry)    do { (_entry)->ready = 1; } while(0)
+
 #endif // _PT_H
@@ -1,74 +1,297 @@
 /*
  * Timers and timed callbacks.
+ *
+ * Running timers and callbacks are kept on delta lists ordered by
+ * deadline; each entry's delay_ms is relative to the entry ahead of it.
+ * The tick only decrements the head of each list, and only touches
+ * further entries when they expire. The cost of keeping the lists
+ * ordered is paid when a timer is reset, in thread context.
  */
 
 #include <stddef.h>
 
+#include <core/pt.h>
 #include <core/timer.h>
 
 #define TIMER_LIST_END              (timer_t *)1
-#define TIMER_CALL_LIST_END         (timer_call_t *)2
+#define TIMER_CALL_DEFER_END        (timer_call_t *)2
 
-#define timer_registered(_timer)    ((_timer)._next != NULL)
+#define timer_running(_timer)       ((_timer)->_next != NULL)
 
 static timer_t          *timer_list = TIMER_LIST_END;
-static timer_call_t     *timer_call_list = TIMER_CALL_LIST_END;
+static timer_t          *timer_call_list = TIMER_LIST_END;
+static volatile uint32_t timer_ms;
+static timer_call_t     *timer_call_deferred = TIMER_CALL_DEFER_END;
+static timer_call_t     *timer_call_deferred_tail;
+
+/*
+ * Remove a timer from a list, handing its remaining delay on to
+ * its successor.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+timer_list_remove(timer_t **list, timer_t *timer)
+{
+    timer_t **tp;
+
+    for (tp = list; *tp != TIMER_LIST_END; tp = &(*tp)->_next) {
+        if (*tp == timer) {
+            if (timer->_next != TIMER_LIST_END) {
+                timer->_next->delay_ms += timer->delay_ms;
+            }
+            *tp = timer->_next;
+            break;
+        }
+    }
+    timer->_next = NULL;
+}
+
+/*
+ * Insert a timer into a list, behind any timers with the same
+ * deadline.
+ *
+ * Must be called with interrupts disabled, and the timer must not
+ * already be on a list.
+ */
+static void
+timer_list_insert(timer_t **list, timer_t *timer, uint16_t delay_ms)
+{
+    timer_t **tp = list;
+
+    while ((*tp != TIMER_LIST_END) && ((*tp)->delay_ms <= delay_ms)) {
+        delay_ms -= (*tp)->delay_ms;
+        tp = &(*tp)->_next;
+    }
+    if (*tp != TIMER_LIST_END) {
+        (*tp)->delay_ms -= delay_ms;
+    }
+    timer->delay_ms = delay_ms;
+    timer->_next = *tp;
+    *tp = timer;
+}
+
+/*
+ * Advance a list by one tick and return the first expired timer,
+ * detached from the list with its _next pointer cleared. Returns
+ * NULL if nothing has expired.
+ *
+ * Must be called with interrupts disabled.
+ */
+static timer_t *
+timer_list_expire(timer_t **list, bool advance)
+{
+    timer_t *t = *list;
+
+    if (t == TIMER_LIST_END) {
+        return NULL;
+    }
+    if (advance && (t->delay_ms > 0)) {
+        t->delay_ms--;
+    }
+    if (t->delay_ms > 0) {
+        return NULL;
+    }
+    *list = t->_next;
+    t->_next = NULL;
+    return t;
+}
+
+uint32_t
+timer_now_ms(void)
+{
+    uint32_t now;
+
+    EnterCritical();
+    now = timer_ms;
+    ExitCritical();
+
+    return now;
+}
+
+uint16_t
+timer_counter_elapsed(uint16_t since)
+{
+    const uint16_t now = timer_counter();
+    const uint16_t modulo = TPM2MOD;
+
+    if ((now >= since) || (modulo == 0)) {
+        return now - since;
+    }
+    // counter has wrapped at the modulo
+    return now + (modulo - since) + 1;
+}
 
 void
-_timer_register(timer_t *timer)
+_timer_reset(timer_t *timer, uint16_t delay_ms)
 {
     EnterCritical();
 
-    if (!timer_registered(*timer)) {
-        // singly-linked insertion at head
-        timer->_next = timer_list;
-        timer_list = timer;
+    if (timer_running(timer)) {
+        timer_list_remove(&timer_list, timer);
+    }
+    if (delay_ms > 0) {
+        timer_list_insert(&timer_list, timer, delay_ms);
     }
 
     ExitCritical();
 }
 
+bool
+_timer_expired(timer_t *timer)
+{
+    bool expired;
+
+    // _next is updated by the tick, so can't be tested non-atomically
+    EnterCritical();
+    expired = !timer_running(timer);
+    ExitCritical();
+
+    return expired;
+}
+
 void
 _timer_call_register(timer_call_t *call)
 {
     EnterCritical();
 
-    if (!timer_registered(*call)) {
+    if (!timer_running(&call->timer) && (call->timer.delay_ms > 0)) {
+        timer_list_insert(&timer_call_list, &call->timer, call->timer.delay_ms);
+    }
 
-        // singly-linked insertion at head
-        call->_next = timer_call_list;
-        timer_call_list = call;
-    }   
+    ExitCritical();
+}
+
+/*
+ * Remove a call from the deferred queue, if it is waiting there.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+timer_call_undefer(timer_call_t *call)
+{
+    timer_call_t **tcp;
+    timer_call_t *prev = NULL;
+
+    if (call->_deferred == NULL) {
+        return;
+    }
+    for (tcp = &timer_call_deferred; *tcp != TIMER_CALL_DEFER_END; tcp = &(*tcp)->_deferred) {
+        if (*tcp == call) {
+            *tcp = call->_deferred;
+            if (timer_call_deferred_tail == call) {
+                timer_call_deferred_tail = prev;
+            }
+            break;
+        }
+        prev = *tcp;
+    }
+    call->_deferred = NULL;
+}
+
+void
+_timer_call_reset(timer_call_t *call, uint16_t delay_ms)
+{
+    EnterCritical();
+
+    // a call that has fallen due but not yet run is dropped too
+    if (timer_running(&call->timer)) {
+        timer_list_remove(&timer_call_list, &call->timer);
+    }
+    timer_call_undefer(call);
+    if (delay_ms > 0) {
+        timer_list_insert(&timer_call_list, &call->timer, delay_ms);
+    }
 
     ExitCritical();
 }
 
 void
-timer_tick(void)
+timer_call_run(void)
 {
-    timer_t *t;
     timer_call_t *tc;
 
-    // update timers
-    for (t = timer_list; t != TIMER_LIST_END; t = t->_next) {
-        if (t->delay_ms > 0) {
-            t->delay_ms--;
+    for (;;) {
+        EnterCritical();
+        tc = timer_call_deferred;
+        if (tc != TIMER_CALL_DEFER_END) {
+            timer_call_deferred = tc->_deferred;
+            tc->_deferred = NULL;
+        }
+        ExitCritical();
+
+        if (tc == TIMER_CALL_DEFER_END) {
+            break;
         }
+        tc->callback();
+    }
+}
+
+bool
+timer_call_pending(void)
+{
+    return timer_call_deferred != TIMER_CALL_DEFER_END;
+}
+
+/*
+ * Queue a callback to be run by timer_call_run.
+ *
+ * Must be called with interrupts disabled.
+ */
+static void
+timer_call_defer(timer_call_t *tc)
+{
+    // still waiting from last time?
+    if (tc->_deferred != NULL) {
+        if (tc->overruns < 255) {
+            tc->overruns++;
+        }
+        return;
+    }
+    tc->_deferred = TIMER_CALL_DEFER_END;
+    if (timer_call_deferred == TIMER_CALL_DEFER_END) {
+        timer_call_deferred = tc;
+    } else {
+        timer_call_deferred_tail->_deferred = tc;
+    }
+    timer_call_deferred_tail = tc;
+}
+
+void
+timer_tick(void)
+{
+    timer_t *t;
+    bool advance;
+
+    timer_ms++;
+
+    // expire timers; everything at the head of the list with zero delay
+    // has reached its deadline
+    advance = TRUE;
+    while (timer_list_expire(&timer_list, advance) != NULL) {
+        advance = FALSE;
+    }
+    if (!advance) {
+        // something expired, wake any threads waiting on timers
+        pt_list_signal(PT_EVENT_TIMER);
     }
 
     // run timer calls
-    for (tc = timer_call_list; tc != TIMER_CALL_LIST_END; tc = tc->_next) {
-
-        // if the call is active...
-        if (tc->delay_ms > 0) {
-            // and the delay expires...
-            if (--tc->delay_ms == 0) {
-                // run the callback
-                tc->callback();
-                // and reload the delay (or leave it at
-                // zero for a one-shot)
-                tc->delay_ms = tc->period_ms;
-            }
+    advance = TRUE;
+    while ((t = timer_list_expire(&timer_call_list, advance)) != NULL) {
+        timer_call_t *tc = (timer_call_t *)t;
+
+        advance = FALSE;
+
+        // re-arm periodic calls before running the callback so that
+        // it can cancel or reset itself
+        if (tc->period_ms > 0) {
+            timer_list_insert(&timer_call_list, t, tc->period_ms);
+        }
+        if (tc->flags & TIMER_CALL_THREAD) {
+            timer_call_defer(tc);
+        } else {
+            tc->callback();
         }
     }
 }
@@ -14,60 +14,115 @@
  */
 extern void timer_tick(void);
 
+/**
+ * Monotonic millisecond clock.
+ *
+ * @return              Milliseconds since the timer tick started.
+ */
+extern uint32_t timer_now_ms(void);
+
+/**
+ * Free-running hardware counter, for measuring short intervals.
+ *
+ * This is the TPM2 counter that drives the tick; it is shared with PWM_7
+ * and so wraps at the TPM2 modulo. timer_counter_elapsed() allows for
+ * one wrap, so intervals longer than a counter period will be under-reported.
+ */
+#define timer_counter()         TPM2CNT
+extern uint16_t                 timer_counter_elapsed(uint16_t since);
+
 /**
  * One-shot timer.
+ *
+ * Running timers are kept in a list ordered by deadline, with each
+ * delay_ms relative to the timer ahead of it, so the tick only has to
+ * look at the head of the list. A timer that is not on the list has
+ * expired.
  */
 typedef struct _timer {
-    struct _timer       *_next;
-    volatile uint16_t   delay_ms;
+    struct _timer       *_next;             // NULL when not running
+    uint16_t            delay_ms;           // delta from the previous timer in the list
 } timer_t;
 
 /**
  *  One-shot or periodic timer callback.
+ *
+ * By default the callback runs in the timer interrupt. Setting
+ * TIMER_CALL_THREAD in flags defers it to timer_call_run() in the main
+ * loop instead; if the callback is still waiting to run when it next
+ * falls due, the call is dropped and counted in overruns.
  */
 typedef struct _timer_call {
-    void                (*callback)(void);  // function to call - must be interrupt-safe
-    volatile uint16_t   delay_ms;
+    timer_t             timer;              // timer.delay_ms is the initial delay, 0 for inactive
+    void                (*callback)(void);  // function to call - must be interrupt-safe unless deferred
     uint16_t            period_ms;          // tick interval between calls, 0 for one-shot
-    struct _timer_call  *_next;
+    uint8_t             flags;
+    uint8_t             overruns;           // missed periods, saturates at 255
+    struct _timer_call  *_deferred;         // deferred call queue link
 } timer_call_t;
 
+#define TIMER_CALL_ISR      0x00            // run the callback in the timer interrupt
+#define TIMER_CALL_THREAD   0x01            // run the callback from timer_call_run()
+
 /**
  * Register a one-shot timer.
- * 
- * @note does nothing to an already-registered timer.
+ *
+ * Timers no longer need to be registered; this is retained so that
+ * existing code continues to compile.
  */
-#define timer_register(_t)      _timer_register(&_t)
-extern void                     _timer_register(timer_t *timer);
+#define timer_register(_t)      do {} while(0)
 
 /**
  * Register a timer callback.
- * 
+ *
+ * The callback will first be called after its initial delay_ms.
+ *
  * @note does nothing to an already-registered callback.
  */
 #define timer_call_register(_t) _timer_call_register(&_t)
 extern void                     _timer_call_register(timer_call_t *call);
 
-/** 
- * Reset a one-shot timer or timer callback
+/**
+ * Reset a one-shot timer
+ *
+ * A delay of zero stops the timer, leaving it expired.
  */
-#define timer_reset(_timer, _delay)         \
-        do {                                \
-            EnterCritical();                \
-            (_timer).delay_ms = _delay;     \
-            ExitCritical();                 \
-        } while(0)
+#define timer_reset(_timer, _delay)     _timer_reset(&(_timer), _delay)
+extern void                             _timer_reset(timer_t *timer, uint16_t delay_ms);
+
+/**
+ * Reset a timer callback
+ *
+ * A delay of zero cancels the callback. Either way, a deferred call that
+ * has fallen due but not yet been run by timer_call_run() is dropped.
+ */
+#define timer_call_reset(_call, _delay) _timer_call_reset(&(_call), _delay)
+extern void                             _timer_call_reset(timer_call_t *call, uint16_t delay_ms);
+
+/**
+ * Run deferred timer callbacks.
+ *
+ * Call from the main loop; runs every TIMER_CALL_THREAD callback that
+ * has fallen due since the last call.
+ */
+extern void                             timer_call_run(void);
+
+/**
+ * Test whether any deferred timer callbacks are waiting to run.
+ */
+extern bool                             timer_call_pending(void);
 
 /**
- * Test whether a timer or callback has expired
+ * Test whether a timer has expired
  */
-#define timer_expired(_timer)           ((_timer).delay_ms == 0)
+#define timer_expired(_timer)           _timer_expired(&(_timer))
+extern bool                             _timer_expired(timer_t *timer);
 
 /**
  * Blocking delay for protothreads
- * 
+ *
  * The current thread will be blocked until the delay has expired.
- * 
+ *
  * @param pt            The current protothread
  * @param timer         The timer to use
  * @param ms            The number of milliseconds to block
@@ -63,13 +63,15 @@
 
 #include <core/can.h>
 #include <core/io.h>
+#include <core/kv.h>
 #include <core/lib.h>
 #include <core/mrs_bootrom.h>
 #include <core/pt.h>
+#include <core/timer.h>
 
 #include <can_devices/blink_keypad.h>
 
-static struct pt pt_can_listener;
+static pt_list_entry_t pt_can_listener = pt_list_entry(can_listen, PT_EVENT_CAN_RX | PT_EVENT_TIMER);
 
 extern void app_init(void);
 extern void app_loop(void);
@@ -87,6 +89,9 @@ void main(void)
 
     // Fix CAN config - PE_low_level_init doesn't know about the EEPROM.
     can_reinit(mrs_can_bitrate());
+    
+    // Start the CAN listener thread.
+    pt_list_register(&pt_can_listener);
 
     // Print / trace work now.
     print("start %c", mrs_module_type);
@@ -104,29 +109,38 @@ void main(void)
     // Start the ADC in continuous mode.
     (void)AD1_Start();
     
+#ifdef CONFIG_KV_STORE
+    kv_init();
+#endif
+
 #ifdef CONFIG_WITH_BLINK_KEYPAD
     bk_init();
 #endif
     
     // Init the application.
     app_init();
+    
+    // Start reporting thread runtimes, if enabled.
+    pt_profile_init();
   
     // Main loop; never exits
     for (;;) {
         (void)WDog1_Clear();                            // must be reset every 1s
 
-        // Run the CAN listener thread and any message-reception callouts
-        can_listen(&pt_can_listener);
-      
-#ifdef CONFIG_WITH_BLINK_KEYPAD
-        bk_loop();
-#endif
-        
-        // Run any registered threads
+        // Run any timer callbacks deferred from the tick interrupt
+        pt_profile(&pt_profile_timer_calls, timer_call_run());
+
+        // Run any registered threads that are ready, including the CAN
+        // listener and any message-reception callouts
         pt_list_run();
         
         // Run the application.
-        app_loop();
+        pt_profile(&pt_profile_app_loop, app_loop());
+        
+        // Sleep until the next interrupt if nothing is runnable; the
+        // timer tick wakes us at least once per millisecond, so the 
+        // watchdog is still cleared.
+        pt_list_idle();
     }
 
   /*** Don't write any code pass this line, or it will be deleted during code generation. ***/
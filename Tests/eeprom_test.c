@@ -0,0 +1,168 @@
+/*
+ * Check the write-behind EEPROM engine against the stand-in IEE1 bean,
+ * which counts program operations: at most one per eeprom_thread pass,
+ * aligned words and longs coalesced, unchanged bytes skipped, and
+ * failures charged only to the writes in the failing operation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+// the thread is run a pass at a time; this is the stripped copy in the
+// build directory
+#include "eeprom.c"
+
+#define EE(_offset)     (IEE1_AREA_START + (_offset))
+
+static unsigned
+sets(void)
+{
+    return host_eeprom_sets[1] + host_eeprom_sets[2] + host_eeprom_sets[4];
+}
+
+/*
+ * Run eeprom_thread until the queue is empty, checking that no pass
+ * does more than one program operation; returns the number of passes.
+ */
+static unsigned
+drain(void)
+{
+    unsigned passes = 0;
+
+    while (eeprom_busy() && (passes < 100)) {
+        const unsigned before = sets();
+
+        eeprom_thread(&eeprom_entry.pt);
+        CHECK((sets() - before) <= 1);
+        passes++;
+    }
+    CHECK(!eeprom_busy());
+    return passes;
+}
+
+/*
+ * Queue a write of len bytes of value at offset.
+ */
+static eeprom_write_t
+fill(uint16_t offset, uint8_t len, uint8_t value)
+{
+    uint8_t data[EEPROM_WRITE_QUEUE_SIZE];
+    eeprom_write_t handle = 0;
+
+    (void)memset(data, value, len);
+    CHECK(eeprom_write(EE(offset), len, data, &handle));
+    return handle;
+}
+
+static void
+check_sets(unsigned bytes, unsigned words, unsigned longs)
+{
+    CHECK(host_eeprom_sets[1] == bytes);
+    CHECK(host_eeprom_sets[2] == words);
+    CHECK(host_eeprom_sets[4] == longs);
+    (void)memset(host_eeprom_sets, 0, sizeof(host_eeprom_sets));
+}
+
+int
+main(void)
+{
+    static const uint8_t frame[6] = {1, 2, 3, 4, 5, 6};
+    eeprom_write_t a;
+    eeprom_write_t b;
+    eeprom_write_t c;
+    unsigned passes;
+    uint16_t errors;
+
+    (void)memset(host_eeprom, 0xff, sizeof(host_eeprom));
+    host_reset();
+
+    // the data of one MRS write frame, which used to be six IEE1_SetByte
+    // calls in a row from the CAN handler
+    CHECK(eeprom_write(EE(0x200), sizeof(frame), frame, &a));
+    CHECK(eeprom_read_byte(EE(0x205)) == 6);
+    CHECK(!eeprom_write_done(a));
+    passes = drain();
+    printf("6-byte write: %u program operations in %u passes, at most 1 per pass (was 6 in one call)\n",
+           sets(), passes);
+    CHECK(eeprom_write_done(a));
+    CHECK(memcmp(&host_eeprom[0x200], frame, sizeof(frame)) == 0);
+    check_sets(0, 1, 1);
+
+    // a full queue
+    (void)fill(0x280, EEPROM_WRITE_QUEUE_SIZE, 0x5a);
+    CHECK(!eeprom_write(EE(0x2c0), 1, frame, NULL));
+    passes = drain();
+    printf("%u-byte write: %u program operations in %u passes\n",
+           EEPROM_WRITE_QUEUE_SIZE, sets(), passes);
+    check_sets(0, 0, EEPROM_WRITE_QUEUE_SIZE / 4);
+
+    // aligned longs and words coalesce, including across writes queued
+    // back to back
+    (void)fill(0x210, 8, 0x11);
+    (void)fill(0x218, 2, 0x22);
+    (void)fill(0x21c, 2, 0x33);
+    (void)fill(0x21e, 2, 0x44);
+    CHECK(drain() == 4);
+    check_sets(0, 1, 3);
+    CHECK((host_eeprom[0x21d] == 0x33) && (host_eeprom[0x21e] == 0x44));
+
+    // a misaligned start doesn't: a byte, then a word, then a long
+    (void)fill(0x221, 7, 0x55);
+    CHECK(drain() == 3);
+    check_sets(1, 1, 1);
+    CHECK((host_eeprom[0x220] == 0xff) && (host_eeprom[0x221] == 0x55) && (host_eeprom[0x227] == 0x55));
+
+    // nor do bytes that aren't queued in address order
+    CHECK(eeprom_write(EE(0x231), 1, &frame[1], NULL));
+    CHECK(eeprom_write(EE(0x230), 1, &frame[0], NULL));
+    CHECK(drain() == 2);
+    check_sets(2, 0, 0);
+
+    // unchanged bytes cost nothing, and are retired in the same pass as
+    // the next change
+    a = fill(0x210, 8, 0x11);
+    CHECK(drain() == 1);
+    CHECK(eeprom_write_done(a));
+    check_sets(0, 0, 0);
+    (void)fill(0x221, 1, 0x55);
+    (void)fill(0x240, 1, 0x66);
+    CHECK(drain() == 1);
+    check_sets(1, 0, 0);
+
+    // a failure is charged to the writes in the failing operation only
+    errors = eeprom_error_count();
+    a = fill(0x250, 2, 0x77);                   // word
+    b = fill(0x253, 1, 0x88);                   // byte
+    c = fill(0x254, 1, 0x99);                   // first half of a long...
+    (void)fill(0x255, 3, 0x99);                 // ...finished by the next write
+    eeprom_thread(&eeprom_entry.pt);
+    host_eeprom_fail = TRUE;
+    eeprom_thread(&eeprom_entry.pt);
+    host_eeprom_fail = FALSE;
+    CHECK(eeprom_write_done(b));
+    CHECK(!eeprom_write_failed(a));
+    CHECK(eeprom_write_failed(b));
+    CHECK(!eeprom_write_done(c));
+    CHECK(eeprom_error_count() == (uint16_t)(errors + 1));
+    host_eeprom_fail = TRUE;
+    (void)drain();
+    host_eeprom_fail = FALSE;
+    CHECK(eeprom_write_failed(c) && eeprom_write_failed((eeprom_write_t)(c + 1)));
+    CHECK(eeprom_error_count() == (uint16_t)(errors + 2));
+    check_sets(1, 1, 1);
+
+    // a new write starts out not failed
+    c = fill(0x260, 1, 0xaa);
+    CHECK(drain() == 1);
+    CHECK(!eeprom_write_failed(c));
+    check_sets(1, 0, 0);
+
+    if (host_failures != 0) {
+        fprintf(stderr, "eeprom_test: %d failures\n", host_failures);
+        return 1;
+    }
+    printf("eeprom_test: ok\n");
+    return 0;
+}
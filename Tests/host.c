@@ -0,0 +1,322 @@
+/*
+ * Host harness for running core modules off-target.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <CAN1.h>
+#include <Cpu.h>
+#include <IEE1.h>
+
+#include <core/can.h>
+#include <core/lib.h>
+#include <core/pt.h>
+#include <core/timer.h>
+
+#include "host.h"
+
+#define HOST_FRAMES     64
+#define HOST_THREADS    8
+#define HOST_CALLS      8
+
+word                    TPM2CNT;
+byte                    host_eeprom[IEE1_AREA_SIZE];
+bool                    host_eeprom_fail;
+unsigned                host_eeprom_sets[5];
+uint16_t                host_last_call_delay;
+int                     host_failures;
+
+static host_frame_t     host_frames[HOST_FRAMES];
+static unsigned         host_frame_head;
+static unsigned         host_frame_count;
+static pt_list_entry_t  *host_threads[HOST_THREADS];
+static unsigned         host_thread_count;
+static timer_call_t     *host_calls[HOST_CALLS];
+
+void
+host_reset(void)
+{
+    host_frame_head = 0;
+    host_frame_count = 0;
+    host_thread_count = 0;
+    (void)memset(host_calls, 0, sizeof(host_calls));
+}
+
+void
+host_frame(can_buf_t *buf, uint32_t id, const char *hex)
+{
+    char *end;
+
+    (void)memset(buf, 0, sizeof(*buf));
+    buf->id = id;
+    for (;;) {
+        const unsigned long value = strtoul(hex, &end, 16);
+
+        if (end == hex) {
+            break;
+        }
+        if (buf->dlc < 8) {
+            buf->data[buf->dlc] = (uint8_t)value;
+        }
+        buf->dlc++;
+        hex = end;
+    }
+}
+
+void
+host_run(void)
+{
+    unsigned pass;
+
+    for (pass = 0; pass < 1000; pass++) {
+        unsigned i;
+
+        for (i = 0; i < HOST_CALLS; i++) {
+            timer_call_t *call = host_calls[i];
+
+            if (call != NULL) {
+                host_calls[i] = NULL;
+                call->callback();
+            }
+        }
+        for (i = 0; i < host_thread_count; i++) {
+            pt_list_entry_t *entry = host_threads[i];
+
+            entry->func(&entry->pt);
+        }
+    }
+}
+
+bool
+host_next(host_frame_t *frame)
+{
+    if (host_frame_count == 0) {
+        return FALSE;
+    }
+    *frame = host_frames[host_frame_head];
+    host_frame_head = (host_frame_head + 1) % HOST_FRAMES;
+    host_frame_count--;
+    return TRUE;
+}
+
+void
+host_fail(const char *file, int line, const char *what)
+{
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+    host_failures++;
+}
+
+void
+host_check_frame(const char *file, int line, uint32_t id, const char *hex)
+{
+    host_frame_t frame;
+    can_buf_t expect;
+
+    host_frame(&expect, id, hex);
+    if (!host_next(&frame)) {
+        fprintf(stderr, "%s:%d: expected %08lx [%s], nothing sent\n",
+                file, line, (unsigned long)id, hex);
+        host_failures++;
+        return;
+    }
+    if ((frame.id != expect.id)
+            || (frame.dlc != expect.dlc)
+            || (memcmp(frame.data, expect.data, frame.dlc) != 0)) {
+        unsigned i;
+
+        fprintf(stderr, "%s:%d: expected %08lx [%s], sent %08lx [",
+                file, line, (unsigned long)id, hex, (unsigned long)frame.id);
+        for (i = 0; i < frame.dlc; i++) {
+            fprintf(stderr, "%s%02x", i ? " " : "", frame.data[i]);
+        }
+        fprintf(stderr, "]\n");
+        host_failures++;
+    }
+}
+
+/*
+ * CAN transmit.
+ */
+bool
+can_tx_ordered(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    host_frame_t *frame;
+
+    if ((dlc > 8) || (host_frame_count == HOST_FRAMES)) {
+        return FALSE;
+    }
+    frame = &host_frames[(host_frame_head + host_frame_count++) % HOST_FRAMES];
+    frame->id = id;
+    frame->dlc = dlc;
+    (void)memcpy(frame->data, data, dlc);
+    return TRUE;
+}
+
+bool
+can_tx_async(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    return can_tx_ordered(id, dlc, data);
+}
+
+void
+can_tx_blocking(uint32_t id, uint8_t dlc, const uint8_t *data)
+{
+    (void)can_tx_ordered(id, dlc, data);
+}
+
+uint8_t
+can_tx_ordered_space(void)
+{
+    return CAN_TX_ORDERED_QUEUE_SIZE;
+}
+
+/*
+ * Threads and timers.
+ */
+void
+pt_list_register(pt_list_entry_t *entry)
+{
+    unsigned i;
+
+    for (i = 0; i < host_thread_count; i++) {
+        if (host_threads[i] == entry) {
+            return;
+        }
+    }
+    if (host_thread_count < HOST_THREADS) {
+        host_threads[host_thread_count++] = entry;
+    }
+}
+
+void
+pt_list_signal(uint8_t events)
+{
+    (void)events;
+}
+
+void
+_timer_call_register(timer_call_t *call)
+{
+    (void)call;
+}
+
+void
+_timer_call_reset(timer_call_t *call, uint16_t delay_ms)
+{
+    unsigned i;
+    unsigned free = HOST_CALLS;
+
+    host_last_call_delay = delay_ms;
+    for (i = 0; i < HOST_CALLS; i++) {
+        if (host_calls[i] == call) {
+            host_calls[i] = NULL;
+        }
+        if (host_calls[i] == NULL) {
+            free = i;
+        }
+    }
+    if ((delay_ms > 0) && (free < HOST_CALLS)) {
+        host_calls[free] = call;
+    }
+}
+
+void
+_timer_reset(timer_t *timer, uint16_t delay_ms)
+{
+    timer->delay_ms = delay_ms;
+}
+
+bool
+_timer_expired(timer_t *timer)
+{
+    (void)timer;
+    return TRUE;
+}
+
+uint16_t
+timer_counter_elapsed(uint16_t since)
+{
+    return (uint16_t)(TPM2CNT - since);
+}
+
+/*
+ * Library.
+ */
+void
+print(const char *format, ...)
+{
+    (void)format;
+}
+
+void
+__require_abort(const char *file, int line)
+{
+    fprintf(stderr, "%s:%d: REQUIRE failed\n", file, line);
+    abort();
+}
+
+/*
+ * EEPROM, addressed as on the target. Each Set call is one program
+ * operation.
+ */
+#define HOST_EEPROM(_addr)  (&host_eeprom[(word)((_addr) - IEE1_AREA_START)])
+
+static byte
+host_eeprom_set(word Addr, dword Data, byte len)
+{
+    host_eeprom_sets[len]++;
+    if (host_eeprom_fail) {
+        return ERR_FAILED;
+    }
+    while (len--) {
+        HOST_EEPROM(Addr)[len] = (byte)Data;
+        Data >>= 8;
+    }
+    return ERR_OK;
+}
+
+byte
+IEE1_SetByte(word Addr, byte Data)
+{
+    return host_eeprom_set(Addr, Data, 1);
+}
+
+byte
+IEE1_GetByte(word Addr, byte *Data)
+{
+    *Data = *HOST_EEPROM(Addr);
+    return ERR_OK;
+}
+
+byte
+IEE1_SetWord(word Addr, word Data)
+{
+    return host_eeprom_set(Addr, Data, 2);
+}
+
+byte
+IEE1_GetWord(word Addr, word *Data)
+{
+    *Data = (word)((HOST_EEPROM(Addr)[0] << 8) | HOST_EEPROM(Addr)[1]);
+    return ERR_OK;
+}
+
+byte
+IEE1_SetLong(word Addr, dword Data)
+{
+    return host_eeprom_set(Addr, Data, 4);
+}
+
+byte
+IEE1_GetLong(word Addr, dword *Data)
+{
+    word hi;
+    word lo;
+
+    (void)IEE1_GetWord(Addr, &hi);
+    (void)IEE1_GetWord(Addr + 2, &lo);
+    *Data = ((dword)hi << 16) | lo;
+    return ERR_OK;
+}
@@ -0,0 +1,65 @@
+/*
+ * Host harness for running core modules off-target.
+ *
+ * Frames sent through can_tx_* are logged, threads passed to
+ * pt_list_register are run by host_run, and timer calls fire from
+ * host_run regardless of their delay.
+ */
+
+#ifndef TESTS_HOST_H_
+#define TESTS_HOST_H_
+
+#include <core/can.h>
+
+typedef struct {
+    uint32_t    id;
+    uint8_t     dlc;
+    uint8_t     data[8];
+} host_frame_t;
+
+/**
+ * Reset the frame log, thread list and pending timer calls.
+ */
+extern void     host_reset(void);
+
+/**
+ * Build a frame from space-separated hex bytes, e.g. "20 10 12 34".
+ */
+extern void     host_frame(can_buf_t *buf, uint32_t id, const char *hex);
+
+/**
+ * Run registered threads and pending timer calls until nothing changes.
+ */
+extern void     host_run(void);
+
+/**
+ * Take the oldest logged frame.
+ *
+ * @return      FALSE if the log is empty.
+ */
+extern bool     host_next(host_frame_t *frame);
+
+/**
+ * Delay passed to the most recent timer_call_reset.
+ */
+extern uint16_t host_last_call_delay;
+
+/**
+ * Test reporting.
+ */
+extern int      host_failures;
+#define CHECK(_cond)                                                            \
+        do {                                                                    \
+            if (!(_cond)) {                                                     \
+                host_fail(__FILE__, __LINE__, #_cond);                          \
+            }                                                                   \
+        } while(0)
+extern void     host_fail(const char *file, int line, const char *what);
+
+/**
+ * Check that the next logged frame is id with the given hex bytes.
+ */
+#define CHECK_FRAME(_id, _hex)  host_check_frame(__FILE__, __LINE__, _id, _hex)
+extern void     host_check_frame(const char *file, int line, uint32_t id, const char *hex);
+
+#endif /* TESTS_HOST_H_ */
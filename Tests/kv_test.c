@@ -0,0 +1,213 @@
+/*
+ * Check the journaled key/value store against the stand-in EEPROM:
+ * append and lookup, the unchanged-value no-op, compaction into the
+ * other half, a reset part way through compaction, generation wrap, and
+ * a torn last record.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+// the store is reset by hand to simulate a reset of the module, which
+// also loses anything still in the EEPROM queue; these are the stripped
+// copies in the build directory
+#include "eeprom.c"
+#include "kv.c"
+
+#define KV_BYTE(_half, _offset) host_eeprom[KV_AREA_START + ((_half) ? KV_HALF_SIZE : 0) + (_offset)]
+
+/*
+ * Simulate a reset: queued EEPROM writes and RAM state are lost, and
+ * the store is found again by kv_init.
+ */
+static void
+reset(void)
+{
+    eeprom_count = 0;
+    kv_gc_active = FALSE;
+    pt_reset(&kv_gc_entry.pt);
+    pt_reset(&eeprom_entry.pt);
+    host_reset();
+    kv_init();
+    host_run();
+}
+
+static bool
+set(uint8_t key, uint8_t len, uint8_t value)
+{
+    uint8_t data[KV_VALUE_MAX];
+
+    (void)memset(data, value, len);
+    return kv_set(key, len, data);
+}
+
+/*
+ * Test that a key holds len bytes of value.
+ */
+static bool
+holds(uint8_t key, uint8_t len, uint8_t value)
+{
+    uint8_t data[KV_VALUE_MAX];
+    uint8_t i;
+
+    if (kv_get(key, data) != len) {
+        return FALSE;
+    }
+    for (i = 0; i < len; i++) {
+        if (data[i] != value) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/*
+ * Fill the current half with records for key 0 until an append no
+ * longer fits, leaving the store compacting; returns the value key 0
+ * ends up with.
+ */
+static uint8_t
+fill(void)
+{
+    uint8_t value[KV_VALUE_MAX];
+
+    (void)kv_get(0, value);
+    while (set(0, 1, (uint8_t)(value[0] + 1))) {
+        value[0]++;
+        host_run();
+    }
+    CHECK(kv_busy());
+    return value[0];
+}
+
+int
+main(void)
+{
+    uint8_t rec[KV_RECORD_MAX];
+    uint8_t value;
+    uint8_t half;
+    uint16_t offset;
+
+    (void)memset(host_eeprom, 0xff, sizeof(host_eeprom));
+    reset();
+
+    // a fresh store starts in the first half, with nothing set
+    CHECK(kv_half == 0);
+    CHECK(KV_BYTE(0, 0) == KV_MAGIC);
+    CHECK(kv_get(3, NULL) == 0);
+
+    // append and lookup; records start on sector boundaries and are
+    // padded out to whole sectors
+    CHECK(set(3, 2, 0x33));
+    CHECK(set(5, KV_VALUE_MAX, 0x55));
+    CHECK(set(3, 1, 0x34));
+    CHECK(holds(3, 1, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+    host_run();
+    CHECK((kv_index[3] % KV_SECTOR_SIZE) == 0);
+    CHECK((kv_index[5] % KV_SECTOR_SIZE) == 0);
+    CHECK(kv_append == (KV_HEADER_SIZE + 8 + 16 + 8));
+    CHECK(KV_BYTE(0, KV_HEADER_SIZE + 7) == 0xff);
+    CHECK(!set(KV_KEYS, 1, 0));
+    CHECK(!set(3, KV_VALUE_MAX + 1, 0));
+    CHECK(!set(3, 0, 0));
+
+    // and survive a reset
+    reset();
+    CHECK(holds(3, 1, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+
+    // an unchanged value is not appended; a change of length is
+    offset = kv_append;
+    CHECK(set(3, 1, 0x34));
+    CHECK(kv_append == offset);
+    CHECK(set(3, 2, 0x34));
+    CHECK(kv_append != offset);
+    host_run();
+
+    // a full half is compacted into the other, after which the append
+    // that didn't fit can be retried
+    value = fill();
+    CHECK(kv_busy());
+    CHECK(!set(1, 1, 0x11));
+    host_run();
+    CHECK(!kv_busy());
+    CHECK(kv_half == 1);
+    CHECK(kv_generation == 1);
+    CHECK(holds(0, 1, value) && holds(3, 2, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+    CHECK(kv_append == (KV_HEADER_SIZE + 8 + 8 + 16));
+    CHECK(set(0, 1, (uint8_t)(value + 1)));
+    host_run();
+    reset();
+    CHECK(kv_half == 1);
+    CHECK(holds(0, 1, (uint8_t)(value + 1)) && holds(3, 2, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+
+    // a reset before the copy has been programmed leaves the old half
+    // current; first with only part of it programmed...
+    value = fill();
+    kv_gc_thread(&kv_gc_entry.pt);
+    eeprom_thread(&eeprom_entry.pt);
+    CHECK(kv_half == 1);
+    reset();
+    CHECK(kv_half == 1);
+    CHECK(holds(0, 1, value) && holds(3, 2, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+
+    // ...then with everything but the header, which is queued last
+    value = fill();
+    for (;;) {
+        kv_gc_thread(&kv_gc_entry.pt);
+        if (!kv_busy()) {
+            break;
+        }
+        eeprom_thread(&eeprom_entry.pt);
+    }
+    CHECK(kv_half == 0);
+    while (eeprom_count > KV_HEADER_LEN) {
+        eeprom_thread(&eeprom_entry.pt);
+    }
+    CHECK(eeprom_slot(0)->address == kv_address(0, 0));
+    reset();
+    CHECK(kv_half == 1);
+    CHECK(holds(0, 1, value) && holds(3, 2, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+
+    // generations wrap: 0 follows 255; renumber the current half as 255
+    // and the other as 254
+    half = kv_half;
+    kv_header(&KV_BYTE(half, 0), 0xff);
+    kv_header(&KV_BYTE(half ^ 1, 0), 0xfe);
+    for (offset = KV_HEADER_SIZE; offset < kv_append; offset += KV_SECTORS(rec[1] + KV_RECORD_OVERHEAD)) {
+        (void)memcpy(rec, &KV_BYTE(half, offset), sizeof(rec));
+        (void)kv_record(&KV_BYTE(half, offset), rec[0], rec[1], &rec[3], 0xff);
+    }
+    reset();
+    CHECK((kv_half == half) && (kv_generation == 0xff));
+    CHECK(holds(0, 1, value) && holds(3, 2, 0x34));
+    value = fill();
+    host_run();
+    CHECK((kv_half != half) && (kv_generation == 0));
+    reset();
+    CHECK((kv_half != half) && (kv_generation == 0));
+    CHECK(holds(0, 1, value) && holds(3, 2, 0x34) && holds(5, KV_VALUE_MAX, 0x55));
+
+    // a torn last record is ignored, and the next append overwrites it
+    offset = kv_append;
+    CHECK(set(7, 4, 0x77));
+    host_run();
+    KV_BYTE(kv_half, offset + 5) ^= 0x01;
+    reset();
+    CHECK(kv_get(7, NULL) == 0);
+    CHECK(kv_append == offset);
+    CHECK(set(9, 2, 0x99));
+    host_run();
+    CHECK(kv_index[9] == offset);
+    reset();
+    CHECK(holds(9, 2, 0x99) && (kv_get(7, NULL) == 0));
+    CHECK(holds(0, 1, value) && holds(5, KV_VALUE_MAX, 0x55));
+
+    if (host_failures != 0) {
+        fprintf(stderr, "kv_test: %d failures\n", host_failures);
+        return 1;
+    }
+    printf("kv_test: ok\n");
+    return 0;
+}
@@ -0,0 +1,201 @@
+/*
+ * Replay the command/response pairs documented at the top of
+ * core/mrs_bootrom.c against the real handlers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <CAN1.h>
+#include <IEE1.h>
+
+#include <config.h>
+
+#include <core/eeprom.h>
+#include <core/mrs_bootrom.h>
+
+#include "host.h"
+
+#define EXT             CAN_EXTENDED_FRAME_ID
+#define SCAN_RSP        (MRS_SCAN_RSP_ID | EXT)
+#define RESPONSE        (MRS_RESPONSE_ID | EXT)
+#define EEPROM_READ     (MRS_EEPROM_READ_ID | EXT)
+
+static bool
+send(uint32_t id, const char *hex)
+{
+    can_buf_t buf;
+
+    host_frame(&buf, id, hex);
+    return mrs_bootrom_rx(&buf);
+}
+
+static bool
+command(const char *hex)
+{
+    return send(MRS_COMMAND_ID | EXT, hex);
+}
+
+static bool
+write(const char *hex)
+{
+    return send(MRS_EEPROM_WRITE_ID | EXT, hex);
+}
+
+static void
+check_quiet(void)
+{
+    host_frame_t frame;
+
+    host_run();
+    CHECK(!host_next(&frame));
+}
+
+int
+main(void)
+{
+    static const uint8_t serial[4] = {0x12, 0x34, 0x56, 0x78};
+    static const uint8_t rate[4] = {0xfa, MRS_CAN_125KBPS, 0xfa, MRS_CAN_125KBPS};
+
+    (void)memset(host_eeprom, 0xff, sizeof(host_eeprom));
+    (void)memcpy(&host_eeprom[MRS_PARAM_ADDR_SERIAL], serial, sizeof(serial));
+    host_eeprom[MRS_PARAM_ADDR_BL_VERS] = 0x00;
+    host_eeprom[MRS_PARAM_ADDR_BL_VERS + 1] = 0x07;
+    (void)memcpy(&host_eeprom[MRS_PARAM_CAN_RATE_1], rate, sizeof(rate));
+    (void)memcpy(&host_eeprom[0x100], "123456789", 9);
+    host_reset();
+
+    CHECK(mrs_can_bitrate() == MRS_CAN_125KBPS);
+
+    // only scan and select are accepted until selected
+    CHECK(!command("20 03 01 00 04"));
+    CHECK(!write("02 00 aa bb"));
+    check_quiet();
+
+    // 00 00 -> 00 id id id id st 00 vv, in the slot for the serial number
+    CHECK(command("00 00"));
+    CHECK(host_last_call_delay == ((0x5678 % MRS_SCAN_SLOTS) * MRS_SCAN_SLOT_MS));
+    host_run();
+    CHECK_FRAME(SCAN_RSP, "00 12 34 56 78 00 00 07");
+
+    // 20 10 id id id id -> 21 10 id id id id 00 00, only for our ID
+    CHECK(command("20 10 12 34 56 79"));
+    check_quiet();
+    CHECK(!command("20 03 01 00 04"));
+    CHECK(command("20 10 12 34 56 78"));
+    CHECK_FRAME(RESPONSE, "21 10 12 34 56 78 00 00");
+
+    // 20 03 aa aa cc -> dd ...
+    CHECK(command("20 03 01 00 04"));
+    CHECK_FRAME(EEPROM_READ, "31 32 33 34");
+    CHECK(command("20 03 00 04 04"));
+    CHECK_FRAME(EEPROM_READ, "12 34 56 78");
+    CHECK(command("20 03 01 00 09"));
+    CHECK_FRAME(EEPROM_READ, "31 32 33 34 35 36 37 38");
+
+    // 20 13 aa aa ll ll -> ss dd ... then ss cc cc
+    CHECK(command("20 13 01 00 00 09"));
+    host_run();
+    CHECK_FRAME(EEPROM_READ, "00 31 32 33 34 35 36 37");
+    CHECK_FRAME(EEPROM_READ, "01 38 39");
+    CHECK_FRAME(EEPROM_READ, "02 29 b1");       // CRC-16/CCITT check value
+
+    // selecting another module abandons a bulk read, as does write disable
+    CHECK(command("20 13 01 00 00 09"));
+    CHECK(command("20 10 12 34 56 79"));
+    check_quiet();
+    CHECK(command("20 10 12 34 56 78"));
+    CHECK_FRAME(RESPONSE, "21 10 12 34 56 78 00 00");
+    CHECK(command("20 13 01 00 00 09"));
+    CHECK(command("20 02"));
+    CHECK_FRAME(RESPONSE, "20 f0 02 00 00");
+    check_quiet();
+
+    // out of range bulk read -> 21 13 0f 00 00
+    CHECK(command("20 13 03 ff 00 02"));
+    CHECK_FRAME(RESPONSE, "21 13 0f 00 00");
+    CHECK(command("20 13 01 00 00 00"));
+    CHECK_FRAME(RESPONSE, "21 13 0f 00 00");
+
+    // write before enable -> 20 e8 0f 00 00
+    CHECK(write("02 00 aa bb"));
+    CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+
+    // 20 11 f3 33 af -> 21 11 01 00 00; the key must match
+    CHECK(!command("20 11 f3 33 00"));
+    check_quiet();
+    CHECK(command("20 11 f3 33 af"));
+    CHECK_FRAME(RESPONSE, "21 11 01 00 00");
+
+    // aa aa ... -> 20 e8 00 00 00 once committed
+#ifndef CONFIG_KV_STORE
+    CHECK(write("02 00 aa bb"));
+    host_run();
+    CHECK_FRAME(RESPONSE, "20 e8 00 00 00");
+    CHECK((host_eeprom[0x200] == 0xaa) && (host_eeprom[0x201] == 0xbb));
+#endif
+
+    // bitrate, with its backup copy
+    CHECK(write("00 5b fb 04"));
+    host_run();
+    CHECK_FRAME(RESPONSE, "20 e8 00 00 00");
+    CHECK((host_eeprom[MRS_PARAM_CAN_RATE_2] == 0xfb) && (host_eeprom[MRS_PARAM_CAN_RATE_2 + 1] == 0x04));
+    CHECK(mrs_can_bitrate() == MRS_CAN_250KBPS);
+
+    // the bitrate and its backup copy are queued together or not at all
+    {
+        static const uint8_t filler[EEPROM_WRITE_QUEUE_SIZE - 3];
+
+        CHECK(eeprom_write(IEE1_AREA_START + 0x300, sizeof(filler), filler, NULL));
+        CHECK(write("00 5b fc 03"));
+        CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+        CHECK(eeprom_write_space() == 3);
+        CHECK(mrs_can_bitrate() == MRS_CAN_250KBPS);
+        host_run();
+        CHECK((host_eeprom[MRS_PARAM_CAN_RATE_2] == 0xfb) && (host_eeprom[MRS_PARAM_CAN_RATE_2 + 1] == 0x04));
+    }
+
+    // bad check code, or a location that isn't writable
+    CHECK(write("00 5b fb 05"));
+    CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+    CHECK(write("00 04 00"));
+    CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+    CHECK(host_eeprom[MRS_PARAM_ADDR_SERIAL] == 0x12);
+
+#ifndef CONFIG_KV_STORE
+    // an empty write is answered straight away
+    CHECK(write("02 00"));
+    CHECK_FRAME(RESPONSE, "20 e8 00 00 00");
+
+    // a write that fails to program -> 20 e8 0f 00 00
+    host_eeprom_fail = TRUE;
+    CHECK(write("02 00 11 22"));
+    host_run();
+    CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+    host_eeprom_fail = FALSE;
+#endif
+
+    // 20 02 -> 20 f0 02 00 00, after which writes are refused
+    CHECK(command("20 02"));
+    CHECK_FRAME(RESPONSE, "20 f0 02 00 00");
+    CHECK(write("02 00 aa bb"));
+    CHECK_FRAME(RESPONSE, "20 e8 0f 00 00");
+
+    // 20 00 -> 2f ff id id id id 00 00, then reset
+    CHECK(command("20 00"));
+    CHECK_FRAME(RESPONSE, "2f ff 12 34 56 78 00 00");
+
+    // a scan deselects
+    CHECK(command("00 00"));
+    host_run();
+    CHECK_FRAME(SCAN_RSP, "00 12 34 56 78 00 00 07");
+    CHECK(!command("20 03 01 00 04"));
+    check_quiet();
+
+    if (host_failures != 0) {
+        fprintf(stderr, "mrs_bootrom_test: %d failures\n", host_failures);
+        return 1;
+    }
+    printf("mrs_bootrom_test: ok\n");
+    return 0;
+}
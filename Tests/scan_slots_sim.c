@@ -0,0 +1,155 @@
+/*
+ * Simulate MRS discovery of N modules on one bus: each module scans
+ * through the real mrs_scan, and the slot it answers in is taken from
+ * the timer delay it asks for. Modules that land in the same slot send
+ * identical IDs at the same time, which arbitration can't separate, so
+ * only a module alone in its slot is heard. The host scans again, one
+ * window apart, until every module has been heard.
+ *
+ * Prints the mean and worst number of scans, and the mean time, to find
+ * N modules with random serial numbers, all scanning from reset. Fails
+ * if any fleet isn't found within SIM_MAX_SCANS, or if modules with
+ * consecutive serial numbers aren't all found by the first scan.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+
+// the module's statics are needed to reload the parameter shadow and
+// set the scan count; this is the stripped copy in the build directory
+#include "mrs_bootrom.c"
+
+#define SIM_TRIALS      2000
+#define SIM_MAX_MODULES 64
+#define SIM_MAX_SCANS   200
+#define SIM_WINDOW_MS   (MRS_SCAN_SLOTS * MRS_SCAN_SLOT_MS)
+
+static uint32_t sim_rand_state = 0x2545f491;
+
+static uint32_t
+sim_rand(void)
+{
+    // xorshift32; fixed seed so runs are repeatable
+    sim_rand_state ^= sim_rand_state << 13;
+    sim_rand_state ^= sim_rand_state >> 17;
+    sim_rand_state ^= sim_rand_state << 5;
+    return sim_rand_state;
+}
+
+/*
+ * Scan as the module with this serial number, which has already seen
+ * scan_count scans; returns its slot.
+ */
+static uint16_t
+sim_slot(uint32_t serial, uint8_t scan_count)
+{
+    can_buf_t buf;
+
+    host_eeprom[MRS_PARAM_ADDR_SERIAL + 0] = (uint8_t)(serial >> 24);
+    host_eeprom[MRS_PARAM_ADDR_SERIAL + 1] = (uint8_t)(serial >> 16);
+    host_eeprom[MRS_PARAM_ADDR_SERIAL + 2] = (uint8_t)(serial >> 8);
+    host_eeprom[MRS_PARAM_ADDR_SERIAL + 3] = (uint8_t)serial;
+    mrs_shadow_valid = FALSE;
+    mrs_scan_count = scan_count;
+
+    host_reset();
+    host_frame(&buf, MRS_COMMAND_ID | CAN_EXTENDED_FRAME_ID, "00 00");
+    CHECK(mrs_bootrom_rx(&buf));
+    return host_last_call_delay / MRS_SCAN_SLOT_MS;
+}
+
+/*
+ * Scan until every module has been heard alone in its slot; returns
+ * the number of scans, or SIM_MAX_SCANS + 1 if some never were.
+ */
+static unsigned
+sim_discover(const uint32_t *serials, unsigned n)
+{
+    static uint8_t count[MRS_SCAN_SLOTS];
+    uint16_t slot[SIM_MAX_MODULES];
+    bool found[SIM_MAX_MODULES];
+    unsigned remaining = n;
+    unsigned scan;
+    unsigned i;
+
+    (void)memset(found, 0, sizeof(found));
+    for (scan = 1; scan <= SIM_MAX_SCANS; scan++) {
+        (void)memset(count, 0, sizeof(count));
+        for (i = 0; i < n; i++) {
+            slot[i] = sim_slot(serials[i], (uint8_t)(scan - 1));
+            CHECK(slot[i] < MRS_SCAN_SLOTS);
+            count[slot[i] % MRS_SCAN_SLOTS]++;
+        }
+        for (i = 0; i < n; i++) {
+            if (!found[i] && (count[slot[i] % MRS_SCAN_SLOTS] == 1)) {
+                found[i] = TRUE;
+                remaining--;
+            }
+        }
+        if (remaining == 0) {
+            return scan;
+        }
+    }
+    return scan;
+}
+
+int
+main(void)
+{
+    static const unsigned modules[] = {2, 4, 8, 12, 16, 20, 24, 32, 48, 64};
+    uint32_t serials[SIM_MAX_MODULES];
+    unsigned m;
+
+    (void)memset(host_eeprom, 0xff, sizeof(host_eeprom));
+
+    printf("MRS_SCAN_SLOTS %u, MRS_SCAN_SLOT_MS %u (%u ms per scan), %u trials per row\n\n",
+           MRS_SCAN_SLOTS, MRS_SCAN_SLOT_MS, SIM_WINDOW_MS, SIM_TRIALS);
+    printf("modules  scans to find all (mean, worst)  mean time (ms)\n");
+
+    for (m = 0; m < (sizeof(modules) / sizeof(modules[0])); m++) {
+        const unsigned n = modules[m];
+        unsigned long total = 0;
+        unsigned worst = 0;
+        unsigned t;
+
+        for (t = 0; t < SIM_TRIALS; t++) {
+            unsigned scans;
+            unsigned i;
+
+            for (i = 0; i < n; i++) {
+                serials[i] = sim_rand();
+            }
+            scans = sim_discover(serials, n);
+            CHECK(scans <= SIM_MAX_SCANS);
+            total += scans;
+            if (scans > worst) {
+                worst = scans;
+            }
+        }
+        printf("%7u  %16.2f %7u  %21.0f\n",
+               n,
+               (double)total / SIM_TRIALS,
+               worst,
+               (double)total * SIM_WINDOW_MS / SIM_TRIALS);
+    }
+
+    // consecutive serial numbers, as in a batch, are all found at once
+    for (m = 0; m < 1000; m++) {
+        const uint32_t base = sim_rand();
+        unsigned i;
+
+        for (i = 0; i < MRS_SCAN_SLOTS; i++) {
+            serials[i] = base + i;
+        }
+        CHECK(sim_discover(serials, MRS_SCAN_SLOTS) == 1);
+    }
+
+    if (host_failures != 0) {
+        fprintf(stderr, "scan_slots_sim: %d failures\n", host_failures);
+        return 1;
+    }
+    printf("\nscan_slots_sim: ok, %u consecutive serial numbers are found by one scan\n", MRS_SCAN_SLOTS);
+    return 0;
+}
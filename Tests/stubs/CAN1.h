@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the Processor Expert CAN bean.
+ */
+
+#ifndef __CAN1
+#define __CAN1
+
+#include <PE_Types.h>
+
+#define CAN_EXTENDED_FRAME_ID   0x80000000UL
+
+#endif /* __CAN1 */
@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the Processor Expert CPU bean.
+ */
+
+#ifndef __Cpu_H
+#define __Cpu_H
+
+#include <PE_Types.h>
+
+extern word TPM2CNT;
+extern word TPM2MOD;
+
+#endif /* __Cpu_H */
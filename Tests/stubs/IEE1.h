@@ -0,0 +1,25 @@
+/*
+ * Host stand-in for the Processor Expert IntEEPROM bean, backed by
+ * host_eeprom[]. Values are big-endian, as on the target.
+ */
+
+#ifndef __IEE1
+#define __IEE1
+
+#include <PE_Types.h>
+
+#define IEE1_AREA_START     0x1400
+#define IEE1_AREA_SIZE      0x400
+
+extern byte     host_eeprom[IEE1_AREA_SIZE];
+extern bool     host_eeprom_fail;       // make every program operation fail
+extern unsigned host_eeprom_sets[5];    // program operations, by size in bytes
+
+extern byte     IEE1_SetByte(word Addr, byte Data);
+extern byte     IEE1_GetByte(word Addr, byte *Data);
+extern byte     IEE1_SetWord(word Addr, word Data);
+extern byte     IEE1_GetWord(word Addr, word *Data);
+extern byte     IEE1_SetLong(word Addr, dword Data);
+extern byte     IEE1_GetLong(word Addr, dword *Data);
+
+#endif /* __IEE1 */
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for the Processor Expert base types.
+ */
+
+#ifndef __PE_Types_H
+#define __PE_Types_H
+
+#include <stdint.h>
+
+typedef unsigned char   bool;
+typedef unsigned char   byte;
+typedef unsigned short  word;
+typedef unsigned long   dword;
+
+#define TRUE            1
+#define FALSE           0
+
+#define ERR_OK          0
+#define ERR_FAILED      27
+
+#define EnterCritical() do {} while(0)
+#define ExitCritical()  do {} while(0)
+
+#endif /* __PE_Types_H */
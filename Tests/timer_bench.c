@@ -0,0 +1,133 @@
+/*
+ * Measure the cost of timer_tick as the number of running timers
+ * grows: 2 to 64 one-shot timers and as many timer calls, all with
+ * deadlines well beyond the run, so that every tick is the common case
+ * of nothing expiring.
+ *
+ * The cost is counted as the list entries the tick looks at; the copy
+ * of timer.c in the build directory is instrumented to count them. A
+ * tick that decremented every timer would look at all of them. Fails
+ * unless the count per tick is the same for every number of timers.
+ */
+
+#include <stdio.h>
+
+#include <core/pt.h>
+
+static unsigned long    timer_bench_touched;
+
+// the module's statics are needed to start each run with empty lists;
+// this is the instrumented copy in the build directory
+#include "timer.c"
+
+#define BENCH_MAX_TIMERS    64
+#define BENCH_TICKS         10000
+
+word                    TPM2CNT;
+word                    TPM2MOD;
+
+static timer_t          bench_timers[BENCH_MAX_TIMERS];
+static timer_call_t     bench_calls[BENCH_MAX_TIMERS];
+static int              bench_failures;
+
+static void
+bench_callback(void)
+{
+}
+
+void
+pt_list_signal(uint8_t events)
+{
+    (void)events;
+}
+
+/*
+ * Start n timers and n timer calls, tick BENCH_TICKS times and return
+ * the most list entries looked at by one tick; the mean is left in
+ * *mean.
+ */
+static unsigned long
+bench_run(unsigned n, double *mean)
+{
+    unsigned long total = 0;
+    unsigned long most = 0;
+    unsigned i;
+
+    timer_list = TIMER_LIST_END;
+    timer_call_list = TIMER_LIST_END;
+    timer_call_deferred = TIMER_CALL_DEFER_END;
+
+    for (i = 0; i < n; i++) {
+        // unordered deadlines, so that inserts land all over the lists
+        const uint16_t delay_ms = (uint16_t)(BENCH_TICKS + 1 + ((i * 37U) % BENCH_MAX_TIMERS) * 500U);
+
+        bench_timers[i]._next = NULL;
+        timer_reset(bench_timers[i], delay_ms);
+
+        bench_calls[i].timer._next = NULL;
+        bench_calls[i].callback = bench_callback;
+        bench_calls[i].period_ms = 0;
+        bench_calls[i].flags = TIMER_CALL_ISR;
+        bench_calls[i]._deferred = NULL;
+        timer_call_reset(bench_calls[i], (uint16_t)(delay_ms + 3));
+    }
+
+    for (i = 0; i < BENCH_TICKS; i++) {
+        timer_bench_touched = 0;
+        timer_tick();
+        total += timer_bench_touched;
+        if (timer_bench_touched > most) {
+            most = timer_bench_touched;
+        }
+    }
+
+    // nothing should have expired
+    for (i = 0; i < n; i++) {
+        if (timer_expired(bench_timers[i])) {
+            fprintf(stderr, "timer_bench: timer %u of %u expired early\n", i, n);
+            bench_failures++;
+        }
+    }
+
+    *mean = (double)total / BENCH_TICKS;
+    return most;
+}
+
+int
+main(void)
+{
+    static const unsigned timers[] = {2, 4, 8, 16, 32, 64};
+    unsigned long baseline = 0;
+    unsigned t;
+
+    printf("%u ticks per row, nothing expiring\n\n", BENCH_TICKS);
+    printf("timers + calls  entries/tick (mean, max)  |  per-tick decrement\n");
+
+    for (t = 0; t < (sizeof(timers) / sizeof(timers[0])); t++) {
+        double mean;
+        const unsigned long most = bench_run(timers[t], &mean);
+
+        printf("%6u + %-6u  %12.2f %10lu  |  %19u\n",
+               timers[t], timers[t], mean, most, 2 * timers[t]);
+
+        if (t == 0) {
+            baseline = most;
+            if (baseline == 0) {
+                fprintf(stderr, "timer_bench: nothing counted; timer.c instrumentation missing\n");
+                bench_failures++;
+            }
+        } else if (most != baseline) {
+            fprintf(stderr, "timer_bench: %u timers cost %lu entries per tick, %u cost %lu\n",
+                    timers[t], most, timers[0], baseline);
+            bench_failures++;
+        }
+    }
+
+    if (bench_failures != 0) {
+        fprintf(stderr, "timer_bench: %d failures\n", bench_failures);
+        return 1;
+    }
+    printf("\ntimer_bench: ok, tick cost is flat from %u to %u timers\n",
+           timers[0], timers[(sizeof(timers) / sizeof(timers[0])) - 1]);
+    return 0;
+}